@@ -6,155 +6,3168 @@
 #include <linux/jiffies.h>
 #include <linux/delay.h>
 #include <linux/wait.h>
+#include <linux/swait.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/math64.h>
+#include <linux/sched/signal.h>
+#include <linux/pwm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/i2c.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/sched/clock.h>
+#include <linux/timex.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/rcupdate.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/seqlock.h>
+#include <linux/irq_work.h>
+#include <uapi/linux/sched/types.h>
+
+#include "hcsr04_ioctl.h"
 
 #define DEVICE_NAME "hcsr04_1"
 #define CLASS_NAME  "hcsr04"
 
-#define TRIGGER_PIN 4 
-#define ECHO_PIN 3
-#define OFFSET_PIN 512
-#define TIMEOUT 50
+#define TRIGGER_PIN 4 
+#define ECHO_PIN 3
+#define OFFSET_PIN 512
+#define TIMEOUT 50
+
+#define SERVO_PERIOD_NS 20000000
+#define SERVO_MAX_DEG 180
+#define MAX_DISTANCE_MM 4000
+
+#define RCWL_I2C_ADDR 0x57
+#define RCWL_MEASURE_MS 120
+
+/*
+ *	Sensor backend, see struct hcsr04_backend_ops below:
+ *		gpio:		HC-SR04 with separate trigger and echo pins (TRIGGER_PIN, ECHO_PIN)
+ *		gpio-single:	three-wire sensors (PING))) and some HC-SR04 variants) sharing one pin (TRIGGER_PIN) for trigger and echo
+ *		rcwl-i2c:	RCWL-9600 style I2C module, which does the timing itself (i2c_bus, i2c_addr)
+ */
+
+static char *backend = "gpio";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Sensor backend: gpio, gpio-single or rcwl-i2c");
+
+static int i2c_bus = 1;
+module_param(i2c_bus, int, 0444);
+MODULE_PARM_DESC(i2c_bus, "I2C bus number of the rcwl-i2c backend");
+
+static unsigned short i2c_addr = RCWL_I2C_ADDR;
+module_param(i2c_addr, ushort, 0444);
+MODULE_PARM_DESC(i2c_addr, "I2C address of the rcwl-i2c backend");
+
+/*
+ *	Minimum quiet time between the end of one ping and the next trigger, so late echoes of the previous burst are not taken for the
+ *	new one. Applies to every ping, priority requests included. It is registered with module_param_cb() in the sampling engine
+ *	section, a change has to fit the period of a running hrtimer engine.
+ */
+
+static unsigned int ping_guard_us = 10000;
+MODULE_PARM_DESC(ping_guard_us, "Quiet time between two pings in us");
+
+/*
+ *	Scanning servo. The PWM is looked up by the name of the PWM controller device (as in /sys/bus/platform/devices, e.g. 3f20c000.pwm)
+ *	and the channel number. When servo_pwm is not set the driver works without scanning support.
+ */
+
+static char *servo_pwm;
+module_param(servo_pwm, charp, 0444);
+MODULE_PARM_DESC(servo_pwm, "PWM controller driving the scanning servo");
+
+static unsigned int servo_channel;
+module_param(servo_channel, uint, 0444);
+MODULE_PARM_DESC(servo_channel, "PWM channel of the scanning servo");
+
+static unsigned int servo_min_us = 1000;
+module_param(servo_min_us, uint, 0444);
+MODULE_PARM_DESC(servo_min_us, "Servo pulse width at 0 degrees");
+
+static unsigned int servo_max_us = 2000;
+module_param(servo_max_us, uint, 0444);
+MODULE_PARM_DESC(servo_max_us, "Servo pulse width at 180 degrees");
+
+static dev_t devt;
+static struct cdev hcsr04_cdev;
+static struct class *hcsr04_class;
+static struct device *hcsr04_device;
+
+static int ret;
+
+static struct gpio_desc *trigger, *echo;
+
+static struct i2c_client *rcwl_client;
+
+static struct pwm_device *servo;
+static struct pwm_lookup servo_lookup;
+
+/*
+ *	The echo IRQ is only enabled while a ping waits for its echo (echo_armed), everything else on the line is noise. echo_isr() follows
+ *	the expected edges in echo_state; edges outside the window, or in the wrong order, are counted as suppressed and ignored.
+ */
+
+enum hcsr04_echo_state {
+	ECHO_IDLE,
+	ECHO_WAIT_RISE,
+	ECHO_WAIT_FALL,
+};
+
+/*
+ *	Clock used by echo_isr() for the edge timestamps, selected in sysfs (clock). The ISR only stores the raw value, hcsr04_gpio_wait()
+ *	converts it to ns and to the ktime_get() time base afterwards. cycles is the raw architecture counter (get_cycles()); its rate
+ *	is calibrated against ktime_get() when it is selected, and ns = cycles * cycles_mult >> CYCLES_SHIFT. local_clock() is only
+ *	comparable on one CPU, so it assumes the echo IRQ is not moved between the two edges. The clock of a ping is fixed in ping_clock
+ *	(and ping_mult) when it starts.
+ */
+
+enum hcsr04_clock {
+	HCSR04_CLOCK_KTIME,
+	HCSR04_CLOCK_MONO_FAST,
+	HCSR04_CLOCK_LOCAL,
+	HCSR04_CLOCK_CYCLES,
+};
+
+static const char *const hcsr04_clock_names[] = { "ktime", "mono_fast", "local", "cycles" };
+
+#define CYCLES_SHIFT 24
+
+#define LATENCY_BUCKETS 32
+
+/*
+ *	Runtime tunables. A published struct hcsr04_config is never changed: readers take it with rcu_dereference() and no lock, writers
+ *	(sysfs, ioctl) copy it under config_lock, change the copy and publish it with hcsr04_config_commit(). The old version is freed
+ *	after every reader that may still see it is done. Each ping copies what it needs into the ping_* fields of struct hcsr04_dev
+ *	when it starts, so a change never affects a ping in flight.
+ */
+
+struct hcsr04_config {
+	struct rcu_head rcu;
+	unsigned int timeout_ms;
+	unsigned int max_distance_mm;
+	int clock;
+	u64 cycles_mult;
+	unsigned int hist_bin_mm, hist_window_ms;
+	struct hcsr04_lut lut;
+	unsigned int nsectors, sector_cycle;
+	struct {
+		u16 start_deg, end_deg;
+	} sectors[HCSR04_SECTORS_MAX];
+};
+
+/*
+ *	Runtime state of the sensor, grouped by who writes it so the IRQ CPU and the reader CPUs do not share cache lines:
+ *		- IRQ hot: written by echo_isr() on every edge. Kept within one cache line (checked in hcsr04_init(), and with
+ *		  "make pahole" against the built module).
+ *		- Reader hot: written by the readers on every ping and sample.
+ *		- Engine: written by the sampling engine on every sample, read by the readers waiting for it.
+ *		- Cold: configuration and state that changes rarely.
+ *
+ *	Pings are serialized by ping_lock. Priority requests (HCSR04_IOC_FRESH) announce themselves in priority_waiting, and normal
+ *	pings step aside on ping_wq until no priority request is waiting, so a priority request waits at most for the ping in flight.
+ */
+
+struct hcsr04_dev {
+	/* IRQ hot */
+	u64 start_stamp ____cacheline_aligned_in_smp;
+	u64 end_stamp;
+	struct swait_queue_head echo_wq;
+	enum hcsr04_echo_state echo_state;
+	int ping_clock;
+	atomic_t echo_armed;
+	bool pulse_ready;
+	bool ping_async;
+	bool ping_extra;
+
+	/* Reader hot */
+	struct mutex ping_lock ____cacheline_aligned_in_smp;
+	wait_queue_head_t ping_wq;
+	atomic_t priority_waiting;
+	ktime_t last_ping_end;
+	u64 ping_mult;
+	unsigned int ping_timeout_ms;
+	spinlock_t hist_lock;
+	struct hcsr04_histogram hist_cur;
+	atomic64_t latency_buckets[LATENCY_BUCKETS];
+
+	/* Engine, see the sampling engine section */
+	spinlock_t engine_lock ____cacheline_aligned_in_smp;
+	u64 engine_seq;
+	struct hcsr04_record engine_last;
+	wait_queue_head_t engine_wq;
+	struct list_head stream_list;
+	int engine;
+	unsigned int engine_period_us, engine_phase_us, engine_clock;
+	struct hrtimer engine_timer;
+	struct irq_work engine_timeout_work;
+	u64 engine_timeout_ns;
+	struct irq_work engine_echo_work;
+	s64 engine_echo_ns;
+	u64 engine_echo_end_ns;
+	raw_spinlock_t engine_trigger_lock;
+	ktime_t engine_ping_trigger, engine_ping_end;
+	struct hrtimer engine_extra_timer;
+	struct irq_work engine_extra_work;
+	int engine_extra;
+	s64 engine_extra_echo_ns;
+	u64 engine_extra_end_ns;
+	struct hcsr04_record engine_extra_record;
+	struct task_struct *engine_task;
+	u64 engine_ticks, engine_overruns, engine_jitter_sum_ns, engine_jitter_max_ns;
+	unsigned int engine_health, engine_health_min;
+	u64 engine_valid, engine_skipped;
+	unsigned int sector_samples;
+	struct hcsr04_sector sector_acc[HCSR04_SECTORS_MAX];
+	seqcount_spinlock_t sector_seqcount;
+	struct hcsr04_sectors sectors;
+	wait_queue_head_t sector_wq;
+	atomic64_t engine_cost_ns;
+	struct mutex engine_ctl;
+
+	/* Cold */
+	int echo_irq ____cacheline_aligned_in_smp;
+	struct hcsr04_config __rcu *config;
+	struct mutex config_lock;
+	s64 dir_switch_ns, dir_switch_max_ns;
+	unsigned long dir_switch_late;
+	struct hcsr04_histogram hist_done;
+	unsigned int servo_deg;
+	struct mutex scan_lock;
+};
+
+/* engine_ctl is ready before hcsr04_init(), setting ping_guard_us at load time takes it */
+
+static struct hcsr04_dev hcsr04 = {
+	.engine_ctl = __MUTEX_INITIALIZER(hcsr04.engine_ctl),
+};
+
+/* One field of the current config, for callers that need nothing else */
+
+#define hcsr04_config_read(field) ({					\
+	typeof(((struct hcsr04_config *)0)->field) __val;		\
+									\
+	rcu_read_lock();						\
+	__val = rcu_dereference(hcsr04.config)->field;			\
+	rcu_read_unlock();						\
+	__val;								\
+})
+
+/* Returns a copy of the current config to change, with config_lock held until hcsr04_config_commit() */
+
+static struct hcsr04_config *hcsr04_config_begin(void) {
+	struct hcsr04_config *cfg;
+
+	mutex_lock(&hcsr04.config_lock);
+
+	cfg = kmemdup(rcu_dereference_protected(hcsr04.config, lockdep_is_held(&hcsr04.config_lock)), sizeof(*cfg), GFP_KERNEL);
+
+	if (!cfg)
+		mutex_unlock(&hcsr04.config_lock);
+
+	return cfg;
+}
+
+static void hcsr04_config_commit(struct hcsr04_config *cfg) {
+	struct hcsr04_config *old;
+
+	old = rcu_replace_pointer(hcsr04.config, cfg, lockdep_is_held(&hcsr04.config_lock));
+
+	mutex_unlock(&hcsr04.config_lock);
+
+	kfree_rcu(old, rcu);
+}
+
+/*
+ *	Statistics are counted per CPU, so echo_isr() on the IRQ CPU and the readers on other CPUs never write the same cache line.
+ *	hcsr04_stats_fold() adds them up when they are read from sysfs.
+ */
+
+enum hcsr04_stat {
+	HCSR04_STAT_PINGS,
+	HCSR04_STAT_TIMEOUTS,
+	HCSR04_STAT_RANGE_ERRORS,
+	HCSR04_STAT_EDGES,
+	HCSR04_STAT_SUPPRESSED,
+	HCSR04_STAT_READS,
+	HCSR04_STAT_STREAM_DROPS,
+	HCSR04_STAT_DEADBAND,
+	HCSR04_STAT_COUNT
+};
+
+static const char *const hcsr04_stat_names[] = { "pings", "timeouts", "range_errors", "edges", "suppressed", "reads", "stream_drops", "deadband" };
+
+struct hcsr04_stats {
+	u64_stats_t count[HCSR04_STAT_COUNT];
+	struct u64_stats_sync syncp;
+};
+
+static DEFINE_PER_CPU(struct hcsr04_stats, hcsr04_stats);
+
+/*
+ *	Counters are incremented from the ISR and from process context. On 64-bit the counters are local64 increments, which are
+ *	safe against the ISR by themselves, and the _irqsave calls do nothing; only on 32-bit do they disable interrupts around the
+ *	seqcount, so an ISR cannot interrupt an update on the same CPU. get_cpu_ptr() keeps the task on its CPU either way.
+ */
+
+static void hcsr04_stat_inc(enum hcsr04_stat stat) {
+	struct hcsr04_stats *stats = get_cpu_ptr(&hcsr04_stats);
+	unsigned long flags;
+
+	flags = u64_stats_update_begin_irqsave(&stats->syncp);
+	u64_stats_inc(&stats->count[stat]);
+	u64_stats_update_end_irqrestore(&stats->syncp, flags);
+
+	put_cpu_ptr(&hcsr04_stats);
+}
+
+static void hcsr04_stats_fold(u64 *sum) {
+	struct hcsr04_stats *stats;
+	u64 count[HCSR04_STAT_COUNT];
+	unsigned int start;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(u64) * HCSR04_STAT_COUNT);
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(&hcsr04_stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+
+			for (i = 0; i < HCSR04_STAT_COUNT; i++)
+				count[i] = u64_stats_read(&stats->count[i]);
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		for (i = 0; i < HCSR04_STAT_COUNT; i++)
+			sum[i] += count[i];
+	}
+}
+
+static irqreturn_t echo_isr(int irq, void *dev_id);
+
+/*
+ *	A backend is everything that depends on how the sensor is wired. ping() runs with ping_lock held and returns the echo length in ns
+ *	(backends that measure the distance themselves convert it back) and the time of the echo end in *end_ns. It fails with -ETIMEDOUT
+ *	without an echo, -EINTR on a signal and -EIO for any bus or pin error, these are the statuses user space sees in a record.
+ *	Everything above it (readers, conversion, calibration, histograms, scanning) is shared by all backends. async backends can also
+ *	start a ping from a timer and complete it in echo_isr(), which the hrtimer engines need.
+ */
+
+struct hcsr04_backend_ops {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+	s64 (*ping)(u64 *end_ns);
+	bool async;
+};
+
+static const struct hcsr04_backend_ops *hcsr04_backend;
+
+/*
+ *	Per open file state. The async part belongs to HCSR04_FORMAT_ASYNC: submitted pings are counted in pending and run one after
+ *	the other by work, which puts the results in the results fifo and wakes up wq. In HCSR04_FORMAT_STREAM the reader is on the
+ *	engine's stream_list instead, and the engine fills the fifo, filtered by the reader's deadband (HCSR04_IOC_SET_DEADBAND). lock
+ *	protects next_id, pending, closing, the deadband state and the fifo; the engine takes it from IRQ context.
+ */
+
+struct hcsr04_reader {
+	u32 format;
+
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	struct work_struct work;
+	u32 next_id, pending;
+	bool closing;
+	struct list_head stream;
+	u32 deadband_mm, heartbeat_ms;
+	bool delivered;
+	struct hcsr04_record last_delivered;
+	u32 sectors_seen;
+	DECLARE_KFIFO(results, struct hcsr04_async_record, HCSR04_ASYNC_MAX);
+};
+
+static u64 hcsr04_clock_read(int clock) {
+
+	switch (clock) {
+	case HCSR04_CLOCK_MONO_FAST:
+		return ktime_get_mono_fast_ns();
+	case HCSR04_CLOCK_LOCAL:
+		return local_clock();
+	case HCSR04_CLOCK_CYCLES:
+		return get_cycles();
+	default:
+		return ktime_get_ns();
+	}
+}
+
+static u64 hcsr04_clock_to_ns(int clock, u64 mult, u64 delta) {
+
+	if (clock == HCSR04_CLOCK_CYCLES)
+		return mul_u64_u64_shr(delta, mult, CYCLES_SHIFT);
+
+	return delta;
+}
+
+static int hcsr04_cycles_calibrate(u64 *mult) {
+	u64 c0, c1, t0, t1;
+
+	c0 = get_cycles();
+	t0 = ktime_get_ns();
+
+	usleep_range(10000, 11000);
+
+	c1 = get_cycles();
+	t1 = ktime_get_ns();
+
+	/* get_cycles() is 0 on architectures without a usable counter */
+	if (c1 <= c0)
+		return -EOPNOTSUPP;
+
+	*mult = div64_u64((t1 - t0) << CYCLES_SHIFT, c1 - c0);
+
+	return 0;
+}
+
+/* ~ GPIO backends ~ */
+
+/* 
+ *	swait_event_interruptible_timeout_exclusive() blocks the process until the interrupt handler sets pulse_ready to true or timeout expires.
+ * 	This avoids busy-waiting and allows other processes to run while we wait for the echo pulse measurement to complete. It is a simple
+ *	wait queue because echo_isr() wakes it from hard IRQ context even on PREEMPT_RT; pings are serialized, so there is only one waiter.
+ */
+
+/* Echo length in ns and echo end in the ktime_get() time base, from the edge stamps of the last echo */
+
+static s64 hcsr04_gpio_result(u64 *end_ns) {
+
+	if (hcsr04.ping_clock == HCSR04_CLOCK_KTIME)
+		*end_ns = hcsr04.end_stamp;
+	else
+		*end_ns = ktime_get_ns() - hcsr04_clock_to_ns(hcsr04.ping_clock, hcsr04.ping_mult, hcsr04_clock_read(hcsr04.ping_clock) - hcsr04.end_stamp);
+
+	return hcsr04_clock_to_ns(hcsr04.ping_clock, hcsr04.ping_mult, hcsr04.end_stamp - hcsr04.start_stamp);
+}
+
+static s64 hcsr04_gpio_wait(u64 *end_ns) {
+
+	swait_event_interruptible_timeout_exclusive(hcsr04.echo_wq, hcsr04.pulse_ready, msecs_to_jiffies(hcsr04.ping_timeout_ms));
+
+	if (!hcsr04.pulse_ready) {
+		*end_ns = ktime_get_ns();
+		return -ETIMEDOUT;
+	}
+
+	return hcsr04_gpio_result(end_ns);
+}
+
+/*
+ *	Disarming happens exactly once per ping, either in echo_isr() on the falling edge or after a timeout; only the side that disarms
+ *	completes the ping. An edge the irqchip latched while the IRQ was disabled is replayed by enable_irq(); it finds the line low in
+ *	ECHO_WAIT_RISE and is suppressed.
+ */
+
+static bool hcsr04_echo_disarm(void) {
+
+	if (!atomic_xchg(&hcsr04.echo_armed, 0))
+		return false;
+
+	disable_irq_nosync(hcsr04.echo_irq);
+
+	return true;
+}
+
+/* Arms the echo IRQ and sends the trigger pulse. Does not sleep, the hrtimer engines call it from their timer. */
+
+static void hcsr04_gpio_start(bool async) {
+
+	hcsr04.pulse_ready = false;
+	hcsr04.ping_async = async;
+	hcsr04.echo_state = ECHO_WAIT_RISE;
+
+	atomic_set(&hcsr04.echo_armed, 1);
+	enable_irq(hcsr04.echo_irq);
+
+	gpiod_set_value(trigger, 1);
+	udelay(10);
+	gpiod_set_value(trigger, 0);
+}
+
+static s64 hcsr04_gpio_ping(u64 *end_ns) {
+	s64 result;
+
+	hcsr04_gpio_start(false);
+
+	result = hcsr04_gpio_wait(end_ns);
+
+	hcsr04_echo_disarm();
+	synchronize_irq(hcsr04.echo_irq);
+	hcsr04.echo_state = ECHO_IDLE;
+
+	return result;
+}
+
+/*
+ *	Single pin ping. gpiolib does not allow driving a line whose IRQ is enabled, so the echo IRQ (requested once, disabled between pings)
+ *	is only enabled after the trigger pulse, once the line is an input again, and disabled again by hcsr04_echo_disarm(). The time the switch
+ *	takes is measured; if the echo already went high during it, the rising edge was never seen and its time is estimated as the middle of the
+ *	switch window.
+ */
+
+static s64 hcsr04_gpio_single_ping(u64 *end_ns) {
+	u64 switch_start, switch_time;
+	s64 switch_ns, result;
+	int err;
+
+	hcsr04.pulse_ready = false;
+	hcsr04.ping_async = false;
+
+	err = gpiod_direction_output(trigger, 1);
+
+	if (err) {
+		*end_ns = ktime_get_ns();
+		return -EIO;
+	}
+
+	udelay(10);
+	gpiod_set_value(trigger, 0);
+
+	switch_start = hcsr04_clock_read(hcsr04.ping_clock);
+	hcsr04.echo_state = ECHO_WAIT_RISE;
+	atomic_set(&hcsr04.echo_armed, 1);
+
+	err = gpiod_direction_input(echo);
+
+	if (err) {
+		pr_err("hcsr04_driver - Error switching the pin back to echo input\n");
+		atomic_set(&hcsr04.echo_armed, 0);
+		hcsr04.echo_state = ECHO_IDLE;
+		*end_ns = ktime_get_ns();
+		return -EIO;
+	}
+
+	enable_irq(hcsr04.echo_irq);
+
+	switch_time = hcsr04_clock_read(hcsr04.ping_clock) - switch_start;
+	switch_ns = hcsr04_clock_to_ns(hcsr04.ping_clock, hcsr04.ping_mult, switch_time);
+
+	hcsr04.dir_switch_ns = switch_ns;
+	hcsr04.dir_switch_max_ns = max(hcsr04.dir_switch_max_ns, switch_ns);
+
+	if (gpiod_get_value(echo) && hcsr04.echo_state == ECHO_WAIT_RISE) {
+		hcsr04.start_stamp = switch_start + switch_time / 2;
+		hcsr04.echo_state = ECHO_WAIT_FALL;
+		hcsr04.dir_switch_late++;
+	}
+
+	result = hcsr04_gpio_wait(end_ns);
+
+	hcsr04_echo_disarm();
+	synchronize_irq(hcsr04.echo_irq);
+	hcsr04.echo_state = ECHO_IDLE;
+
+	return result;
+}
+
+static int hcsr04_gpio_setup(bool single) {
+
+	trigger = gpio_to_desc(TRIGGER_PIN + OFFSET_PIN);
+
+	if (!trigger) {
+		pr_err("hcsr04_driver - Error getting pin 4\n");
+		return -ENODEV;
+	}
+
+	/* In single pin mode the line idles as an input, the sensor holds it low between pings */
+
+	if (single) {
+		echo = trigger;
+	}
+	else {
+		echo = gpio_to_desc(ECHO_PIN + OFFSET_PIN);
+
+		if (!echo) {
+			pr_err("hcsr04_driver - Error getting pin 3\n");
+			return -ENODEV;
+		}
+
+		ret = gpiod_direction_output(trigger, 0);
+
+		if (ret) {
+			pr_err("hcsr04_driver - Error setting pin 4 to output\n");
+			return ret;
+		}
+	}
+
+	ret = gpiod_direction_input(echo);
+
+	if (ret) {
+		pr_err("hcsr04_driver - Error setting pin 3 to input\n");
+		return ret;
+	}
+
+	hcsr04.echo_irq = gpiod_to_irq(echo);
+
+	if (hcsr04.echo_irq < 0) {
+		pr_err("hcsr04_driver - Error getting an IRQ number for the ECHO pin\n");
+		return hcsr04.echo_irq;
+	}
+
+	return 0;
+}
+
+static int hcsr04_gpio_request_irq(void) {
+
+	/*
+	 *	IRQF_NO_AUTOEN: the IRQ stays disabled until a ping arms it. IRQF_NO_THREAD: echo_isr() runs in hard IRQ context also where
+	 *	handlers are force threaded (PREEMPT_RT, threadirqs), so the edge is stamped when it happens and synchronize_hardirq() waits
+	 *	for the whole handler. echo_isr() takes no sleeping lock for that, see there.
+	 */
+
+	ret = request_irq(hcsr04.echo_irq, echo_isr, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_NO_AUTOEN | IRQF_NO_THREAD,
+			  "echo_irq_handler", NULL);
+
+	if (ret)
+		pr_err("hcsr04_driver - Error registering an IRQ for the ECHO pin\n");
+
+	return ret;
+}
+
+static int hcsr04_gpio_init(void) {
+
+	ret = hcsr04_gpio_setup(false);
+
+	if (ret)
+		return ret;
+
+	return hcsr04_gpio_request_irq();
+}
+
+static void hcsr04_gpio_exit(void) {
+	free_irq(hcsr04.echo_irq, NULL);
+}
+
+/* In single pin mode the line is still an input here, the IRQ can be requested once like with two pins */
+
+static int hcsr04_gpio_single_init(void) {
+
+	ret = hcsr04_gpio_setup(true);
+
+	if (ret)
+		return ret;
+
+	return hcsr04_gpio_request_irq();
+}
+
+/* ~ RCWL-9600 I2C backend ~ */
+
+/*
+ *	The module starts a measurement when 0x01 is written to it and after ~100 ms returns the distance in um as three bytes, MSB first.
+ *	Adapters without plain I2C transfers (like i2c-stub, which emulates SMBus only) get three single byte reads instead.
+ */
+
+static s64 hcsr04_rcwl_ping(u64 *end_ns) {
+	u8 buf[3];
+	int err, i;
+	u32 um;
+
+	err = i2c_smbus_write_byte(rcwl_client, 0x01);
+
+	if (err)
+		goto bus_error;
+
+	if (msleep_interruptible(RCWL_MEASURE_MS))
+		return -EINTR;
+
+	if (i2c_check_functionality(rcwl_client->adapter, I2C_FUNC_I2C)) {
+		err = i2c_master_recv(rcwl_client, buf, sizeof(buf));
+
+		if (err != sizeof(buf))
+			goto bus_error;
+	}
+	else {
+		for (i = 0; i < sizeof(buf); i++) {
+			err = i2c_smbus_read_byte(rcwl_client);
+
+			if (err < 0)
+				goto bus_error;
+
+			buf[i] = err;
+		}
+	}
+
+	*end_ns = ktime_get_ns();
+
+	um = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+
+	if (!um)
+		return -ETIMEDOUT;
+
+	/* Back to an echo length, so the shared conversion stage applies (5800 ns per mm = 29 ns per 5 um) */
+	return div_u64((u64)um * 29, 5);
+
+	/* Whatever the adapter reported (-ENXIO for a missing module, -EREMOTEIO, -ETIMEDOUT of the bus...) becomes one status */
+bus_error:
+	*end_ns = ktime_get_ns();
+
+	return -EIO;
+}
+
+static int hcsr04_rcwl_init(void) {
+	struct i2c_adapter *adapter;
+
+	adapter = i2c_get_adapter(i2c_bus);
+
+	if (!adapter) {
+		pr_err("hcsr04_driver - I2C bus %d not found\n", i2c_bus);
+		return -ENODEV;
+	}
+
+	rcwl_client = i2c_new_dummy_device(adapter, i2c_addr);
+	i2c_put_adapter(adapter);
+
+	if (IS_ERR(rcwl_client)) {
+		pr_err("hcsr04_driver - Error creating the I2C client at 0x%02x\n", i2c_addr);
+		return PTR_ERR(rcwl_client);
+	}
+
+	return 0;
+}
+
+static void hcsr04_rcwl_exit(void) {
+	i2c_unregister_device(rcwl_client);
+}
+
+static const struct hcsr04_backend_ops hcsr04_backends[] = {
+	{
+		.name = "gpio",
+		.init = hcsr04_gpio_init,
+		.exit = hcsr04_gpio_exit,
+		.ping = hcsr04_gpio_ping,
+		.async = true,
+	},
+	{
+		.name = "gpio-single",
+		.init = hcsr04_gpio_single_init,
+		.exit = hcsr04_gpio_exit,
+		.ping = hcsr04_gpio_single_ping,
+	},
+	{
+		.name = "rcwl-i2c",
+		.init = hcsr04_rcwl_init,
+		.exit = hcsr04_rcwl_exit,
+		.ping = hcsr04_rcwl_ping,
+	},
+};
+
+/*
+ *	hcsr04_ping() takes one measurement through the backend. Returns the echo pulse length in ns or a negative error, and the time of the
+ *	echo end in *end_ns. priority requests go ahead of all normal pings that have not started yet.
+ */
+
+/* Settings of the ping about to start, see struct hcsr04_config */
+
+static void hcsr04_ping_snapshot(void) {
+	const struct hcsr04_config *cfg;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(hcsr04.config);
+	hcsr04.ping_clock = cfg->clock;
+	hcsr04.ping_mult = cfg->cycles_mult;
+	hcsr04.ping_timeout_ms = cfg->timeout_ms;
+	rcu_read_unlock();
+}
+
+static s64 hcsr04_ping(bool priority, u64 *end_ns) {
+	s64 guard_us, result;
+
+	if (priority) {
+		atomic_inc(&hcsr04.priority_waiting);
+		result = mutex_lock_interruptible(&hcsr04.ping_lock);
+		atomic_dec(&hcsr04.priority_waiting);
+		wake_up_interruptible(&hcsr04.ping_wq);
+
+		if (result)
+			return result;
+	}
+	else {
+		for (;;) {
+			if (wait_event_interruptible(hcsr04.ping_wq, !atomic_read(&hcsr04.priority_waiting)))
+				return -EINTR;
+
+			if (mutex_lock_interruptible(&hcsr04.ping_lock))
+				return -EINTR;
+
+			if (!atomic_read(&hcsr04.priority_waiting))
+				break;
+
+			mutex_unlock(&hcsr04.ping_lock);
+		}
+	}
+
+	/*
+	 *	While an engine runs it owns the sensor, everybody else takes its samples (see hcsr04_measure()). Only a priority request
+	 *	pings between the pings of a kthread engine; the engine thread's next ping waits for it and the guard like any other.
+	 */
+	if (READ_ONCE(hcsr04.engine) && current != hcsr04.engine_task && !(priority && hcsr04.engine_task)) {
+		mutex_unlock(&hcsr04.ping_lock);
+		return -EAGAIN;
+	}
+
+	guard_us = ping_guard_us - ktime_us_delta(ktime_get(), hcsr04.last_ping_end);
+
+	if (guard_us > 0)
+		usleep_range(guard_us, guard_us + 100);
+
+	hcsr04_ping_snapshot();
+
+	result = hcsr04_backend->ping(end_ns);
+
+	hcsr04.last_ping_end = ktime_get();
+
+	hcsr04_stat_inc(HCSR04_STAT_PINGS);
+
+	if (result == -ETIMEDOUT)
+		hcsr04_stat_inc(HCSR04_STAT_TIMEOUTS);
+
+	mutex_unlock(&hcsr04.ping_lock);
+
+	return result;
+}
+
+/*
+ *	Conversion stage: echo length to mm (sound travels 1 mm and back in ~5800 ns), then the calibration table if one is loaded.
+ *	The table is at most 32 points (256 bytes), so the binary search stays in cache and the interpolation is integer only.
+ */
+
+static s64 hcsr04_echo_to_raw_mm(s64 echo_ns) {
+	return div64_s64(echo_ns, 5800);
+}
+
+static s64 hcsr04_echo_to_mm(const struct hcsr04_config *cfg, s64 echo_ns) {
+	const struct hcsr04_lut_point *p0, *p1;
+	const struct hcsr04_lut *lut = &cfg->lut;
+	s64 raw_mm = hcsr04_echo_to_raw_mm(echo_ns);
+	unsigned int lo, hi, mid;
+
+	if (!lut->count)
+		return raw_mm;
+
+	lo = 0;
+	hi = lut->count - 1;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+
+		if (raw_mm < lut->points[mid].raw_mm)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	p0 = &lut->points[lo];
+	p1 = &lut->points[hi];
+
+	return p0->cal_mm + div64_s64((raw_mm - p0->raw_mm) * ((s64)p1->cal_mm - p0->cal_mm), (s64)p1->raw_mm - p0->raw_mm);
+}
+
+/*
+ *	Histogram accumulator, fed with every distance the driver reports (err is 0) and every failed ping (err is the error).
+ *	When the configured window has passed, the current histogram becomes the completed one and a new window starts.
+ */
+
+static void hcsr04_hist_reset(struct hcsr04_histogram *hist, unsigned int bin_mm, u64 now) {
+	memset(hist, 0, sizeof(*hist));
+	hist->window_start_ns = now;
+	hist->bin_mm = bin_mm;
+	hist->nbins = HCSR04_HIST_BINS;
+}
+
+static void hcsr04_hist_add(const struct hcsr04_config *cfg, s64 distance_mm, int err) {
+	unsigned int window_ms = cfg->hist_window_ms;
+	unsigned long flags;
+	u64 now, bin;
+
+	if (!cfg->hist_bin_mm)
+		return;
+
+	now = ktime_get_ns();
+
+	spin_lock_irqsave(&hcsr04.hist_lock, flags);
+
+	if (!hcsr04.hist_cur.bin_mm) {
+		spin_unlock_irqrestore(&hcsr04.hist_lock, flags);
+		return;
+	}
+
+	if (window_ms && now - hcsr04.hist_cur.window_start_ns >= (u64)window_ms * NSEC_PER_MSEC) {
+		hcsr04.hist_done = hcsr04.hist_cur;
+		hcsr04.hist_done.window_ns = now - hcsr04.hist_cur.window_start_ns;
+		hcsr04_hist_reset(&hcsr04.hist_cur, hcsr04.hist_cur.bin_mm, now);
+	}
+
+	hcsr04.hist_cur.total++;
+
+	if (err) {
+		hcsr04.hist_cur.errors++;
+	}
+	else {
+		bin = div_u64(distance_mm, hcsr04.hist_cur.bin_mm);
+		hcsr04.hist_cur.bins[min_t(u64, bin, HCSR04_HIST_BINS - 1)]++;
+	}
+
+	spin_unlock_irqrestore(&hcsr04.hist_lock, flags);
+}
+
+/*
+ *	hcsr04_record_fill() turns the result of one ping into a record: conversion, range check and histogram. It does not sleep,
+ *	so the engines can use it from the ISR as well. All three steps use the same config, a change published in between does not
+ *	split a sample across two versions.
+ */
+
+static void hcsr04_record_fill(struct hcsr04_record *record, s64 echo_ns, u64 end_ns) {
+	const struct hcsr04_config *cfg;
+	s64 distance_mm;
+
+	memset(record, 0, sizeof(*record));
+
+	rcu_read_lock();
+	cfg = rcu_dereference(hcsr04.config);
+
+	record->timestamp_ns = end_ns;
+
+	if (echo_ns < 0) {
+		record->status = -echo_ns;
+	}
+	else {
+		distance_mm = hcsr04_echo_to_mm(cfg, echo_ns);
+
+		if (distance_mm < 0 || distance_mm > cfg->max_distance_mm) {
+			record->status = ERANGE;
+			hcsr04_stat_inc(HCSR04_STAT_RANGE_ERRORS);
+		}
+		else {
+			record->distance_mm = distance_mm;
+		}
+	}
+
+	hcsr04_hist_add(cfg, record->distance_mm, record->status);
+
+	rcu_read_unlock();
+}
+
+/* ~ Sampling engine ~ */
+
+/*
+ *	With an engine running the driver pings on its own, every engine_period_us, instead of once per read. The engine owns the
+ *	sensor: every reader takes the next engine sample (hcsr04_engine_wait()), and stream readers (HCSR04_FORMAT_STREAM) get all of them
+ *	in their fifo. The engines differ in what drives the schedule:
+ *		hrtimer:	hard IRQ hrtimer starts the ping, echo_isr() completes it. A ping without echo is completed as a timeout
+ *				by the next tick, so the period should be above the echo timeout. The timer callback and echo_isr()
+ *				(IRQF_NO_THREAD) stay in hard IRQ context even on PREEMPT_RT, so they only trigger and stamp edges: they
+ *				take no spinlock_t and wake nobody, the sample is committed from engine_echo_work or, for a timeout,
+ *				engine_timeout_work (irq_works, which RT runs in a thread).
+ *		hrtimer_soft:	the same from a softirq hrtimer.
+ *		fifo:		a SCHED_FIFO kthread doing normal pings.
+ *		deadline:	a SCHED_DEADLINE kthread doing normal pings, with the period as its deadline period.
+ *	Every engine keeps tick statistics: jitter is the delay of a tick against its planned time, the cost is CPU time per tick
+ *	(timer callback and completion in the ISR, or the kthread runtime).
+ *
+ *	Ticks are planned on an absolute grid, k * period + phase on engine_clock, never relative to the previous tick. A late tick does
+ *	not shift the ones after it (ticks that are missed entirely count as overruns), and two engines with the same period and clock
+ *	keep their phase difference, also on different boards when their clocks are synchronized (CLOCK_TAI follows PTP/NTP time).
+ *
+ *	The engine also scores the sensor: health is an EWMA of valid samples (weight 1/8, HEALTH_ONE is 100 %). A sensor that keeps
+ *	timing out (disconnected, blocked, facing open space) would spend a full echo timeout on every tick. Below engine_health_min
+ *	it is parked and only pinged every HEALTH_PROBE_TICKS ticks; a valid probe brings it back to half health and the full rate.
+ *
+ *	A priority request (HCSR04_IOC_FRESH) gets its own ping between two ticks, the grid does not move for it. With a kthread engine
+ *	the requester pings itself through hcsr04_ping(): it holds ping_lock and goes ahead of the engine thread, which pings after it and
+ *	the guard. With an hrtimer engine the requester sets engine_extra_timer, a one-shot timer that triggers an extra ping once the
+ *	engine ping in flight has completed or timed out and the guard has passed (engine_extra). When the extra ping with its timeout
+ *	and guard does not fit before the next tick, the request takes the next engine sample instead, so it waits about a period at
+ *	most (a parked sensor only answers with its next probe). Extra pings are not engine samples, stream readers do not see them.
+ */
+
+enum hcsr04_engine {
+	ENGINE_NONE,
+	ENGINE_HRTIMER,
+	ENGINE_HRTIMER_SOFT,
+	ENGINE_FIFO,
+	ENGINE_DEADLINE,
+};
+
+static const char *const hcsr04_engine_names[] = { "none", "hrtimer", "hrtimer_soft", "fifo", "deadline" };
+
+static const char *const hcsr04_engine_clock_names[] = { "monotonic", "tai" };
+static const clockid_t hcsr04_engine_clockids[] = { CLOCK_MONOTONIC, CLOCK_TAI };
+
+#define ENGINE_MIN_PERIOD_US 10000
+#define ENGINE_DL_RUNTIME_NS (500 * NSEC_PER_USEC)
+
+#define HEALTH_ONE 1024
+#define HEALTH_PROBE_TICKS 8
+
+/* Priority request state of the hrtimer engines, in engine_extra under engine_trigger_lock */
+
+enum hcsr04_engine_extra {
+	EXTRA_OFF,		/* no hrtimer engine running */
+	EXTRA_IDLE,
+	EXTRA_WAITING,		/* requested, engine_extra_timer is set for the trigger */
+	EXTRA_ARMED,		/* extra ping in flight, engine_extra_timer is set for its timeout */
+	EXTRA_NEXT,		/* no room before the next tick, the next engine sample answers */
+	EXTRA_DONE,		/* the answer is in engine_extra_record */
+};
+
+static enum hrtimer_mode hcsr04_engine_timer_mode(int engine) {
+	return engine == ENGINE_HRTIMER ? HRTIMER_MODE_ABS_HARD : HRTIMER_MODE_ABS_SOFT;
+}
+
+/*
+ *	The hrtimer engines trigger on every tick without looking at the echo timeout or the guard time, a ping without echo only ends
+ *	at the next tick. Their period has to leave room for a whole timeout plus the guard. The kthread engines ping through
+ *	hcsr04_ping(), which waits for both anyway.
+ */
+
+static int hcsr04_engine_check_period(int engine, unsigned int period_us, unsigned int timeout_ms, unsigned int guard_us) {
+
+	if (engine != ENGINE_HRTIMER && engine != ENGINE_HRTIMER_SOFT)
+		return 0;
+
+	if (period_us < (u64)timeout_ms * USEC_PER_MSEC + guard_us)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int ping_guard_us_set(const char *val, const struct kernel_param *kp) {
+	unsigned int guard_us;
+	int err;
+
+	err = kstrtouint(val, 0, &guard_us);
+
+	if (err)
+		return err;
+
+	mutex_lock(&hcsr04.engine_ctl);
+
+	/* Without an engine the config may not exist yet (parameters are set before hcsr04_init()), the timeout does not matter then */
+	if (hcsr04.engine != ENGINE_NONE)
+		err = hcsr04_engine_check_period(hcsr04.engine, hcsr04.engine_period_us, hcsr04_config_read(timeout_ms), guard_us);
+
+	if (!err)
+		WRITE_ONCE(ping_guard_us, guard_us);
+
+	mutex_unlock(&hcsr04.engine_ctl);
+
+	return err;
+}
+
+static const struct kernel_param_ops ping_guard_us_ops = {
+	.set = ping_guard_us_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(ping_guard_us, &ping_guard_us_ops, &ping_guard_us, 0644);
+
+/* Publishes one sample: the last one for hcsr04_engine_wait(), and a copy to every stream reader. A full fifo drops its oldest sample. */
+
+/* Called with reader->lock held. A sample passes if it moved out of the deadband, changed status or is due as heartbeat. */
+
+static bool hcsr04_deadband_pass(struct hcsr04_reader *reader, const struct hcsr04_record *record) {
+	const struct hcsr04_record *last = &reader->last_delivered;
+
+	if (reader->deadband_mm && reader->delivered && record->status == last->status &&
+	    abs((s64)record->distance_mm - last->distance_mm) <= reader->deadband_mm &&
+	    (!reader->heartbeat_ms || record->timestamp_ns - last->timestamp_ns < (u64)reader->heartbeat_ms * NSEC_PER_MSEC))
+		return false;
+
+	reader->last_delivered = *record;
+	reader->delivered = true;
+
+	return true;
+}
+
+/*
+ *	Sector reduction, with engine_lock held. The running minimum of every sector is kept in sector_acc; at the end of a cycle it is
+ *	published in sectors under sector_seqcount, so readers copy a consistent snapshot without taking engine_lock.
+ */
+
+static void hcsr04_sectors_clear(void) {
+	unsigned int i;
+
+	hcsr04.sector_samples = 0;
+
+	for (i = 0; i < HCSR04_SECTORS_MAX; i++) {
+		memset(&hcsr04.sector_acc[i], 0, sizeof(hcsr04.sector_acc[i]));
+		hcsr04.sector_acc[i].status = ENODATA;
+	}
+}
+
+static void hcsr04_sectors_add(const struct hcsr04_record *record) {
+	const struct hcsr04_config *cfg;
+	unsigned int deg = READ_ONCE(hcsr04.servo_deg), i, nsectors, cycle;
+	struct hcsr04_sector *acc;
+
+	rcu_read_lock();
+
+	cfg = rcu_dereference(hcsr04.config);
+	nsectors = cfg->nsectors;
+	cycle = cfg->sector_cycle;
+
+	for (i = 0; i < nsectors && !record->status; i++) {
+		acc = &hcsr04.sector_acc[i];
+
+		if (deg < cfg->sectors[i].start_deg || deg > cfg->sectors[i].end_deg)
+			continue;
+
+		if (acc->status || record->distance_mm < acc->min_mm) {
+			acc->timestamp_ns = record->timestamp_ns;
+			acc->min_mm = record->distance_mm;
+			acc->angle_deg = deg;
+			acc->status = 0;
+		}
+	}
+
+	rcu_read_unlock();
+
+	if (++hcsr04.sector_samples < cycle)
+		return;
+
+	write_seqcount_begin(&hcsr04.sector_seqcount);
+	hcsr04.sectors.cycle++;
+	hcsr04.sectors.count = nsectors;
+	memcpy(hcsr04.sectors.sectors, hcsr04.sector_acc, sizeof(hcsr04.sector_acc));
+	write_seqcount_end(&hcsr04.sector_seqcount);
+
+	hcsr04_sectors_clear();
+
+	wake_up_interruptible(&hcsr04.sector_wq);
+}
+
+static void hcsr04_sectors_read(struct hcsr04_sectors *sectors) {
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&hcsr04.sector_seqcount);
+		*sectors = hcsr04.sectors;
+	} while (read_seqcount_retry(&hcsr04.sector_seqcount, seq));
+}
+
+static void hcsr04_engine_commit(s64 echo_ns, u64 end_ns) {
+	struct hcsr04_async_record result;
+	struct hcsr04_reader *reader;
+	unsigned long flags;
+
+	hcsr04_record_fill(&result.record, echo_ns, end_ns);
+	result.reserved = 0;
+
+	spin_lock_irqsave(&hcsr04.engine_lock, flags);
+
+	result.id = ++hcsr04.engine_seq;
+	hcsr04.engine_last = result.record;
+
+	hcsr04.engine_health = hcsr04.engine_health - hcsr04.engine_health / 8 + (result.record.status ? 0 : HEALTH_ONE / 8);
+
+	if (!result.record.status) {
+		hcsr04.engine_valid++;
+
+		/* A successful probe of a parked sensor brings it back to the full rate */
+		if (hcsr04.engine_health * 100 < READ_ONCE(hcsr04.engine_health_min) * HEALTH_ONE)
+			hcsr04.engine_health = HEALTH_ONE / 2;
+	}
+
+	hcsr04_sectors_add(&result.record);
+
+	list_for_each_entry(reader, &hcsr04.stream_list, stream) {
+		spin_lock(&reader->lock);
+
+		if (!hcsr04_deadband_pass(reader, &result.record)) {
+			spin_unlock(&reader->lock);
+			hcsr04_stat_inc(HCSR04_STAT_DEADBAND);
+			continue;
+		}
+
+		if (kfifo_is_full(&reader->results)) {
+			kfifo_skip(&reader->results);
+			hcsr04_stat_inc(HCSR04_STAT_STREAM_DROPS);
+		}
+
+		kfifo_put(&reader->results, result);
+
+		spin_unlock(&reader->lock);
+
+		wake_up_interruptible(&reader->wq);
+	}
+
+	spin_unlock_irqrestore(&hcsr04.engine_lock, flags);
+
+	/* A priority request that found no room before this tick takes its sample */
+	raw_spin_lock_irqsave(&hcsr04.engine_trigger_lock, flags);
+
+	if (hcsr04.engine_extra == EXTRA_NEXT) {
+		hcsr04.engine_extra_record = result.record;
+		hcsr04.engine_extra = EXTRA_DONE;
+	}
+
+	raw_spin_unlock_irqrestore(&hcsr04.engine_trigger_lock, flags);
+
+	wake_up_interruptible(&hcsr04.engine_wq);
+}
+
+/* Returns -EAGAIN if the engine stopped before the next sample */
+
+static int hcsr04_engine_wait(struct hcsr04_record *record) {
+	unsigned long flags;
+	u64 seq = READ_ONCE(hcsr04.engine_seq);
+	int err = 0;
+
+	if (wait_event_interruptible(hcsr04.engine_wq, READ_ONCE(hcsr04.engine_seq) != seq || !READ_ONCE(hcsr04.engine)))
+		return -EINTR;
+
+	spin_lock_irqsave(&hcsr04.engine_lock, flags);
+
+	if (hcsr04.engine_seq != seq)
+		*record = hcsr04.engine_last;
+	else
+		err = -EAGAIN;
+
+	spin_unlock_irqrestore(&hcsr04.engine_lock, flags);
+
+	return err;
+}
+
+static ktime_t hcsr04_engine_now(void) {
+	return hcsr04.engine_clock ? ktime_get_clocktai() : ktime_get();
+}
+
+/* First grid point after now */
+
+static ktime_t hcsr04_engine_first(ktime_t now) {
+	u64 period_ns = (u64)hcsr04.engine_period_us * NSEC_PER_USEC;
+	u64 k = div64_u64(ktime_to_ns(now), period_ns) + 1;
+
+	return ns_to_ktime(k * period_ns + (u64)hcsr04.engine_phase_us * NSEC_PER_USEC);
+}
+
+static void hcsr04_engine_tick(ktime_t planned, ktime_t now) {
+	u64 jitter_ns = max_t(s64, ktime_to_ns(ktime_sub(now, planned)), 0);
+
+	hcsr04.engine_ticks++;
+	hcsr04.engine_jitter_sum_ns += jitter_ns;
+	hcsr04.engine_jitter_max_ns = max(hcsr04.engine_jitter_max_ns, jitter_ns);
+}
+
+/* A parked sensor is only pinged on every HEALTH_PROBE_TICKS-th tick */
+
+static bool hcsr04_engine_skip(void) {
+	if (READ_ONCE(hcsr04.engine_health) * 100 >= READ_ONCE(hcsr04.engine_health_min) * HEALTH_ONE ||
+	    hcsr04.engine_ticks % HEALTH_PROBE_TICKS == 0)
+		return false;
+
+	hcsr04.engine_skipped++;
+
+	return true;
+}
+
+static void hcsr04_engine_timeout_fn(struct irq_work *work) {
+	hcsr04_engine_commit(-ETIMEDOUT, READ_ONCE(hcsr04.engine_timeout_ns));
+}
+
+static void hcsr04_engine_echo_fn(struct irq_work *work) {
+	u64 start_ns = ktime_get_ns();
+
+	hcsr04_engine_commit(READ_ONCE(hcsr04.engine_echo_ns), READ_ONCE(hcsr04.engine_echo_end_ns));
+
+	atomic64_add(ktime_get_ns() - start_ns, &hcsr04.engine_cost_ns);
+}
+
+/* Hands the result of an extra ping to the priority request, from engine_extra_work because echo_isr() may not take spinlock_t */
+
+static void hcsr04_engine_extra_done(s64 echo_ns, u64 end_ns) {
+	WRITE_ONCE(hcsr04.engine_extra_echo_ns, echo_ns);
+	WRITE_ONCE(hcsr04.engine_extra_end_ns, end_ns);
+	irq_work_queue(&hcsr04.engine_extra_work);
+}
+
+static void hcsr04_engine_extra_work_fn(struct irq_work *work) {
+	struct hcsr04_record record;
+	unsigned long flags;
+
+	hcsr04_record_fill(&record, READ_ONCE(hcsr04.engine_extra_echo_ns), READ_ONCE(hcsr04.engine_extra_end_ns));
+
+	raw_spin_lock_irqsave(&hcsr04.engine_trigger_lock, flags);
+
+	if (hcsr04.engine_extra == EXTRA_ARMED) {
+		hcsr04.engine_extra_record = record;
+		hcsr04.engine_extra = EXTRA_DONE;
+	}
+
+	raw_spin_unlock_irqrestore(&hcsr04.engine_trigger_lock, flags);
+
+	wake_up(&hcsr04.engine_wq);
+}
+
+/*
+ *	Called with engine_trigger_lock held. Completes the ping in flight as a timeout that ended at end, returns false if there is none.
+ *	echo_isr() is never threaded (IRQF_NO_THREAD), so synchronize_hardirq() makes sure it is not in the middle of that ping on another
+ *	CPU before the state is reset for the next one.
+ */
+
+static bool hcsr04_engine_stale(ktime_t end) {
+
+	if (!hcsr04_echo_disarm())
+		return false;
+
+	synchronize_hardirq(hcsr04.echo_irq);
+	hcsr04.echo_state = ECHO_IDLE;
+	hcsr04.engine_ping_end = end;
+	hcsr04_stat_inc(HCSR04_STAT_TIMEOUTS);
+
+	if (hcsr04.ping_extra) {
+		hcsr04_engine_extra_done(-ETIMEDOUT, ktime_get_ns());
+	}
+	else {
+		WRITE_ONCE(hcsr04.engine_timeout_ns, ktime_get_ns());
+		irq_work_queue(&hcsr04.engine_timeout_work);
+	}
+
+	return true;
+}
+
+/* Called with engine_trigger_lock held. Earliest extra trigger: the guard after the ping in flight has completed or timed out. */
+
+static ktime_t hcsr04_engine_extra_earliest(void) {
+	u64 guard_ns = (u64)READ_ONCE(ping_guard_us) * NSEC_PER_USEC;
+
+	if (atomic_read(&hcsr04.echo_armed))
+		return ktime_add_ns(hcsr04.engine_ping_trigger, (u64)hcsr04.ping_timeout_ms * NSEC_PER_MSEC + guard_ns);
+
+	return ktime_add_ns(hcsr04.engine_ping_end, guard_ns);
+}
+
+/* engine_extra_timer: the trigger of an extra ping, then its timeout */
+
+static enum hrtimer_restart hcsr04_engine_extra_fn(struct hrtimer *timer) {
+	enum hrtimer_mode mode = hcsr04_engine_timer_mode(hcsr04.engine);
+	ktime_t now = hrtimer_cb_get_time(timer), earliest;
+	u64 timeout_ns, guard_ns = (u64)READ_ONCE(ping_guard_us) * NSEC_PER_USEC;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&hcsr04.engine_trigger_lock, flags);
+
+	switch (hcsr04.engine_extra) {
+	case EXTRA_ARMED:
+		/* The tick may already have timed the extra ping out and started its own */
+		if (hcsr04.ping_extra)
+			hcsr04_engine_stale(now);
+		break;
+	case EXTRA_WAITING:
+		earliest = hcsr04_engine_extra_earliest();
+
+		/* The engine ping in flight timed out, it is completed here instead of at the next tick */
+		if (!ktime_before(now, earliest) && hcsr04_engine_stale(ktime_sub_ns(earliest, guard_ns)))
+			earliest = hcsr04_engine_extra_earliest();
+
+		if (ktime_before(now, earliest)) {
+			hrtimer_start(timer, earliest, mode);
+			break;
+		}
+
+		/* The extra ping, its full timeout and the guard after it have to end before the next tick */
+		hcsr04_ping_snapshot();
+		timeout_ns = (u64)hcsr04.ping_timeout_ms * NSEC_PER_MSEC;
+
+		if (ktime_after(ktime_add_ns(now, timeout_ns + guard_ns), hrtimer_get_expires(&hcsr04.engine_timer))) {
+			hcsr04.engine_extra = EXTRA_NEXT;
+			break;
+		}
+
+		hcsr04.ping_extra = true;
+		hcsr04.engine_ping_trigger = now;
+		hcsr04_gpio_start(true);
+		hcsr04_stat_inc(HCSR04_STAT_PINGS);
+		hcsr04.engine_extra = EXTRA_ARMED;
+
+		hrtimer_start(timer, ktime_add_ns(now, timeout_ns), mode);
+		break;
+	default:
+		break;
+	}
+
+	raw_spin_unlock_irqrestore(&hcsr04.engine_trigger_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart hcsr04_engine_timer_fn(struct hrtimer *timer) {
+	ktime_t now = hrtimer_cb_get_time(timer);
+	u64 overruns, start_ns = ktime_get_ns();
+	unsigned long flags;
+
+	/* engine_trigger_lock keeps the tick and an extra ping apart, and the expiry stable for hcsr04_engine_extra_fn() */
+	raw_spin_lock_irqsave(&hcsr04.engine_trigger_lock, flags);
+
+	hcsr04_engine_tick(hrtimer_get_expires(timer), now);
+
+	/* The previous ping is still armed, its echo never came */
+	hcsr04_engine_stale(now);
+
+	if (!hcsr04_engine_skip()) {
+		hcsr04_ping_snapshot();
+		hcsr04.ping_extra = false;
+		hcsr04.engine_ping_trigger = now;
+		hcsr04_gpio_start(true);
+		hcsr04_stat_inc(HCSR04_STAT_PINGS);
+	}
+
+	atomic64_add(ktime_get_ns() - start_ns, &hcsr04.engine_cost_ns);
+
+	/* Forwarding from the expiry time in whole periods keeps the timer on the grid */
+	overruns = hrtimer_forward(timer, now, us_to_ktime(hcsr04.engine_period_us));
+
+	if (overruns > 1)
+		hcsr04.engine_overruns += overruns - 1;
+
+	raw_spin_unlock_irqrestore(&hcsr04.engine_trigger_lock, flags);
+
+	return HRTIMER_RESTART;
+}
+
+static int hcsr04_engine_thread(void *data) {
+	clockid_t clockid = hcsr04_engine_clockids[hcsr04.engine_clock];
+	ktime_t period = us_to_ktime(hcsr04.engine_period_us);
+	ktime_t now, planned = hcsr04_engine_first(hcsr04_engine_now());
+	u64 runtime, end_ns, missed;
+	s64 echo_ns;
+
+	for (;;) {
+		/*
+		 *	The state is set before testing for a stop: kthread_stop() sets the flag and then wakes the thread, so either the
+		 *	test sees the flag or the wakeup puts the thread back to TASK_RUNNING and the sleep returns at once. Testing first
+		 *	could miss both and sleep until the next grid point, a whole period for kthread_stop() to wait.
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+
+		schedule_hrtimeout_range_clock(&planned, 0, HRTIMER_MODE_ABS, clockid);
+
+		if (kthread_should_stop())
+			break;
+
+		hcsr04_engine_tick(planned, hcsr04_engine_now());
+
+		if (!hcsr04_engine_skip()) {
+			runtime = current->se.sum_exec_runtime;
+
+			echo_ns = hcsr04_ping(false, &end_ns);
+
+			if (echo_ns != -EINTR)
+				hcsr04_engine_commit(echo_ns, end_ns);
+
+			atomic64_add(current->se.sum_exec_runtime - runtime, &hcsr04.engine_cost_ns);
+		}
+
+		/* Next grid point, skipping the ones this ping ran over */
+		planned = ktime_add(planned, period);
+		now = hcsr04_engine_now();
+
+		if (ktime_after(now, planned)) {
+			missed = div64_u64(ktime_to_ns(ktime_sub(now, planned)), ktime_to_ns(period)) + 1;
+			hcsr04.engine_overruns += missed;
+			planned = ktime_add_ns(planned, missed * ktime_to_ns(period));
+		}
+	}
+
+	return 0;
+}
+
+/* Called with engine_ctl held. Pings in flight finish first, after that the engine owns the sensor. */
+
+static int hcsr04_engine_start(int engine) {
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_DEADLINE,
+		.sched_runtime = ENGINE_DL_RUNTIME_NS,
+		.sched_deadline = (u64)hcsr04.engine_period_us * NSEC_PER_USEC,
+		.sched_period = (u64)hcsr04.engine_period_us * NSEC_PER_USEC,
+	};
+	struct task_struct *task = NULL;
+	enum hrtimer_mode mode = hcsr04_engine_timer_mode(engine);
+	int err;
+
+	err = hcsr04_engine_check_period(engine, hcsr04.engine_period_us, hcsr04_config_read(timeout_ms), READ_ONCE(ping_guard_us));
+
+	if (err)
+		return err;
+
+	/* The timer drives the trigger line itself, that needs a GPIO controller that does not sleep */
+	if ((engine == ENGINE_HRTIMER || engine == ENGINE_HRTIMER_SOFT) && (!hcsr04_backend->async || gpiod_cansleep(trigger)))
+		return -EOPNOTSUPP;
+
+	if (engine == ENGINE_FIFO || engine == ENGINE_DEADLINE) {
+		task = kthread_create(hcsr04_engine_thread, NULL, "hcsr04_engine");
+
+		if (IS_ERR(task))
+			return PTR_ERR(task);
+
+		if (engine == ENGINE_FIFO) {
+			sched_set_fifo(task);
+		}
+		else {
+			err = sched_setattr_nocheck(task, &attr);
+
+			if (err) {
+				kthread_stop(task);
+				return err;
+			}
+		}
+	}
+
+	hcsr04.engine_ticks = 0;
+	hcsr04.engine_overruns = 0;
+	hcsr04.engine_jitter_sum_ns = 0;
+	hcsr04.engine_jitter_max_ns = 0;
+	atomic64_set(&hcsr04.engine_cost_ns, 0);
+	hcsr04.engine_health = HEALTH_ONE;
+	hcsr04.engine_valid = 0;
+	hcsr04.engine_skipped = 0;
+
+	spin_lock_irq(&hcsr04.engine_lock);
+	hcsr04_sectors_clear();
+	spin_unlock_irq(&hcsr04.engine_lock);
+
+	/* The timers are set up before the engine is published, a priority request may start engine_extra_timer right after */
+	if (!task) {
+		hrtimer_setup(&hcsr04.engine_timer, hcsr04_engine_timer_fn, hcsr04_engine_clockids[hcsr04.engine_clock], mode);
+		hrtimer_setup(&hcsr04.engine_extra_timer, hcsr04_engine_extra_fn, hcsr04_engine_clockids[hcsr04.engine_clock], mode);
+
+		raw_spin_lock_irq(&hcsr04.engine_trigger_lock);
+		hcsr04.engine_ping_end = 0;
+		hcsr04.engine_extra = EXTRA_IDLE;
+		raw_spin_unlock_irq(&hcsr04.engine_trigger_lock);
+	}
+
+	mutex_lock(&hcsr04.ping_lock);
+	hcsr04.engine_task = task;
+	WRITE_ONCE(hcsr04.engine, engine);
+	mutex_unlock(&hcsr04.ping_lock);
+
+	if (task)
+		wake_up_process(task);
+	else
+		hrtimer_start(&hcsr04.engine_timer, hcsr04_engine_first(hcsr04_engine_now()), mode);
+
+	return 0;
+}
+
+/* Called with engine_ctl held */
+
+static void hcsr04_engine_stop(void) {
+
+	switch (hcsr04.engine) {
+	case ENGINE_NONE:
+		return;
+	case ENGINE_HRTIMER:
+	case ENGINE_HRTIMER_SOFT:
+		/* A priority request waiting for an extra ping holds ping_lock, it gives up first (see hcsr04_engine_extra()) */
+		raw_spin_lock_irq(&hcsr04.engine_trigger_lock);
+		hcsr04.engine_extra = EXTRA_OFF;
+		raw_spin_unlock_irq(&hcsr04.engine_trigger_lock);
+		wake_up(&hcsr04.engine_wq);
+
+		hrtimer_cancel(&hcsr04.engine_timer);
+		hrtimer_cancel(&hcsr04.engine_extra_timer);
+		irq_work_sync(&hcsr04.engine_timeout_work);
+		irq_work_sync(&hcsr04.engine_echo_work);
+		irq_work_sync(&hcsr04.engine_extra_work);
+		hcsr04_echo_disarm();
+		synchronize_irq(hcsr04.echo_irq);
+		hcsr04.echo_state = ECHO_IDLE;
+		hcsr04.ping_extra = false;
+		break;
+	default:
+		kthread_stop(hcsr04.engine_task);
+		break;
+	}
+
+	mutex_lock(&hcsr04.ping_lock);
+	hcsr04.engine_task = NULL;
+	WRITE_ONCE(hcsr04.engine, ENGINE_NONE);
+	hcsr04.last_ping_end = ktime_get();
+	mutex_unlock(&hcsr04.ping_lock);
+
+	wake_up_interruptible(&hcsr04.engine_wq);
+}
+
+/*
+ *	Priority request while an hrtimer engine runs: one extra ping between two ticks, see the sampling engine section. ping_lock
+ *	serializes the requests. Returns -EAGAIN when the engine is stopping or stopped.
+ */
+
+static int hcsr04_engine_extra(struct hcsr04_record *record) {
+	int engine, err = 0;
+
+	if (mutex_lock_interruptible(&hcsr04.ping_lock))
+		return -EINTR;
+
+	raw_spin_lock_irq(&hcsr04.engine_trigger_lock);
+
+	if (hcsr04.engine_extra != EXTRA_IDLE) {
+		raw_spin_unlock_irq(&hcsr04.engine_trigger_lock);
+		mutex_unlock(&hcsr04.ping_lock);
+
+		/* An hrtimer engine is stopping, wait until it is gone instead of spinning through hcsr04_measure() */
+		engine = READ_ONCE(hcsr04.engine);
+
+		if ((engine == ENGINE_HRTIMER || engine == ENGINE_HRTIMER_SOFT) &&
+		    wait_event_interruptible(hcsr04.engine_wq, READ_ONCE(hcsr04.engine) != engine ||
+							       READ_ONCE(hcsr04.engine_extra) != EXTRA_OFF))
+			return -EINTR;
+
+		return -EAGAIN;
+	}
+
+	hcsr04.engine_extra = EXTRA_WAITING;
+	hrtimer_start(&hcsr04.engine_extra_timer, hcsr04_engine_extra_earliest(), hcsr04_engine_timer_mode(hcsr04.engine));
+
+	raw_spin_unlock_irq(&hcsr04.engine_trigger_lock);
+
+	if (wait_event_interruptible(hcsr04.engine_wq, READ_ONCE(hcsr04.engine_extra) == EXTRA_DONE ||
+						       READ_ONCE(hcsr04.engine_extra) == EXTRA_OFF))
+		err = -EINTR;
+
+	raw_spin_lock_irq(&hcsr04.engine_trigger_lock);
+
+	/* Not triggered yet, engine_extra_fn() finds nothing to do. An extra ping in flight is at most timeout_ms away and finishes. */
+	if (hcsr04.engine_extra == EXTRA_WAITING || hcsr04.engine_extra == EXTRA_NEXT)
+		hcsr04.engine_extra = EXTRA_IDLE;
+
+	raw_spin_unlock_irq(&hcsr04.engine_trigger_lock);
+
+	wait_event(hcsr04.engine_wq, READ_ONCE(hcsr04.engine_extra) != EXTRA_ARMED);
+
+	raw_spin_lock_irq(&hcsr04.engine_trigger_lock);
+
+	if (hcsr04.engine_extra == EXTRA_DONE) {
+		if (!err)
+			*record = hcsr04.engine_extra_record;
+
+		hcsr04.engine_extra = EXTRA_IDLE;
+	}
+	else if (!err) {
+		err = -EAGAIN;
+	}
+
+	raw_spin_unlock_irq(&hcsr04.engine_trigger_lock);
+
+	mutex_unlock(&hcsr04.ping_lock);
+
+	return err;
+}
+
+/*
+ *	hcsr04_measure() is one complete measurement: ping, conversion and histogram, or the next engine sample while an engine runs.
+ *	Failed pings are returned in record->status, the return value is only an error if the caller was interrupted before the ping.
+ *	A priority request does not take the next engine sample, it gets a ping of its own between two ticks.
+ */
+
+static int hcsr04_measure(struct hcsr04_record *record, bool priority) {
+	int engine, err;
+	s64 echo_ns;
+	u64 end_ns;
+
+	for (;;) {
+		engine = READ_ONCE(hcsr04.engine);
+
+		if (engine && !priority) {
+			err = hcsr04_engine_wait(record);
+
+			if (err != -EAGAIN)
+				return err;
+		}
+		else if (engine == ENGINE_HRTIMER || engine == ENGINE_HRTIMER_SOFT) {
+			err = hcsr04_engine_extra(record);
+
+			if (err != -EAGAIN)
+				return err;
+
+			continue;
+		}
+
+		echo_ns = hcsr04_ping(priority, &end_ns);
+
+		if (echo_ns == -EINTR)
+			return -EINTR;
+
+		if (echo_ns != -EAGAIN)
+			break;
+	}
+
+	hcsr04_record_fill(record, echo_ns, end_ns);
+
+	return 0;
+}
+
+/*
+ *	Delivery latency: time from the echo end to the moment the sample is handed to user space, counted in power of two buckets
+ *	(bucket i holds latencies below 2^i ns). Returns the latency so it can go into the record as well.
+ */
+
+static u32 hcsr04_latency_account(u64 timestamp_ns) {
+	u64 latency_ns = ktime_get_ns() - timestamp_ns;
+
+	atomic64_inc(&hcsr04.latency_buckets[min(fls64(latency_ns), LATENCY_BUCKETS - 1)]);
+
+	return min_t(u64, latency_ns, U32_MAX);
+}
+
+static ssize_t hcsr04_read_records(char __user *user_buffer, size_t len) {
+	struct hcsr04_record record;
+	size_t i, n = len / sizeof(record);
+
+	if (!n)
+		return -EINVAL;
+
+	for (i = 0; i < n; i++) {
+
+		if (i && signal_pending(current))
+			break;
+
+		if (hcsr04_measure(&record, false))
+			return i ? i * sizeof(record) : -EINTR;
+
+		if (!record.status)
+			record.latency_ns = hcsr04_latency_account(record.timestamp_ns);
+
+		if (copy_to_user(user_buffer + i * sizeof(record), &record, sizeof(record)))
+			return i ? i * sizeof(record) : -EFAULT;
+	}
+
+	return i * sizeof(record);
+}
+
+/*
+ *	Split-phase pings. The work item runs the submitted pings of its reader in order; the ids follow from the order, the result of the
+ *	first pending ping is always next_id - pending.
+ */
+
+static void hcsr04_async_work(struct work_struct *work) {
+	struct hcsr04_reader *reader = container_of(work, struct hcsr04_reader, work);
+	struct hcsr04_async_record result = { 0 };
+
+	for (;;) {
+		spin_lock_irq(&reader->lock);
+
+		if (!reader->pending || reader->closing) {
+			spin_unlock_irq(&reader->lock);
+			return;
+		}
+
+		result.id = reader->next_id - reader->pending;
+
+		spin_unlock_irq(&reader->lock);
+
+		if (hcsr04_measure(&result.record, false))
+			result.record.status = EINTR;
+
+		spin_lock_irq(&reader->lock);
+		kfifo_put(&reader->results, result);
+		reader->pending--;
+		spin_unlock_irq(&reader->lock);
+
+		wake_up_interruptible(&reader->wq);
+	}
+}
+
+/* Room for the results is reserved here, so kfifo_put() in the work item never finds the fifo full */
+
+static int hcsr04_async_submit(struct hcsr04_reader *reader, u32 count, u32 *first_id) {
+
+	if (!count)
+		return -EINVAL;
+
+	/* The format is checked under the lock, so hcsr04_set_format() sees every submitted ping in pending */
+	spin_lock_irq(&reader->lock);
+
+	if (reader->format != HCSR04_FORMAT_ASYNC) {
+		spin_unlock_irq(&reader->lock);
+		return -EINVAL;
+	}
+
+	if (count > HCSR04_ASYNC_MAX - reader->pending - kfifo_len(&reader->results)) {
+		spin_unlock_irq(&reader->lock);
+		return -EBUSY;
+	}
+
+	*first_id = reader->next_id;
+	reader->next_id += count;
+	reader->pending += count;
+
+	spin_unlock_irq(&reader->lock);
+
+	queue_work(system_unbound_wq, &reader->work);
+
+	return 0;
+}
+
+static ssize_t hcsr04_read_async(struct file *filp, char __user *user_buffer, size_t len) {
+	struct hcsr04_reader *reader = filp->private_data;
+	struct hcsr04_async_record result;
+	size_t n = 0;
+
+	if (len < sizeof(result))
+		return -EINVAL;
+
+	if (kfifo_is_empty(&reader->results)) {
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(reader->wq, !kfifo_is_empty(&reader->results)))
+			return -EINTR;
+	}
+
+	while (n + sizeof(result) <= len && kfifo_out_spinlocked(&reader->results, &result, 1, &reader->lock)) {
+
+		if (!result.record.status)
+			result.record.latency_ns = hcsr04_latency_account(result.record.timestamp_ns);
+
+		if (copy_to_user(user_buffer + n, &result, sizeof(result)))
+			return n ? n : -EFAULT;
+
+		n += sizeof(result);
+	}
+
+	return n;
+}
+
+static ssize_t hcsr04_read_sectors(struct file *filp, char __user *user_buffer, size_t len) {
+	struct hcsr04_reader *reader = filp->private_data;
+	struct hcsr04_sectors sectors;
+
+	if (len < sizeof(sectors))
+		return -EINVAL;
+
+	if (READ_ONCE(hcsr04.sectors.cycle) == reader->sectors_seen) {
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(hcsr04.sector_wq, READ_ONCE(hcsr04.sectors.cycle) != reader->sectors_seen))
+			return -EINTR;
+	}
+
+	hcsr04_sectors_read(&sectors);
+	reader->sectors_seen = sectors.cycle;
+
+	if (copy_to_user(user_buffer, &sectors, sizeof(sectors)))
+		return -EFAULT;
+
+	return sizeof(sectors);
+}
+
+static ssize_t get_distance(struct file *filp, char __user *user_buffer, size_t len, loff_t *off) {
+    struct hcsr04_reader *reader = filp->private_data;
+    char buffer[64];
+    int buffer_len, not_copied, to_copy;
+    struct hcsr04_record record;
+    s64 distance_cm;
+
+    hcsr04_stat_inc(HCSR04_STAT_READS);
+
+    if (reader->format == HCSR04_FORMAT_BINARY)
+        return hcsr04_read_records(user_buffer, len);
+
+    if (reader->format == HCSR04_FORMAT_ASYNC || reader->format == HCSR04_FORMAT_STREAM)
+        return hcsr04_read_async(filp, user_buffer, len);
+
+    if (reader->format == HCSR04_FORMAT_SECTORS)
+        return hcsr04_read_sectors(filp, user_buffer, len);
+
+    if (*off > 0) {
+        *off = 0;
+        return 0;
+    }
+
+    /* Pings (or takes the next engine sample), converts and counts the sample in the histogram */
+    if (hcsr04_measure(&record, false))
+        return -EINTR;
+
+    if (record.status == ERANGE) {
+        pr_err("hcsr04_driver - distance out of range!\n");
+        return -ERANGE;
+    }
+
+    if (record.status)
+        return -record.status;
+
+    distance_cm = record.distance_mm / 10;
+
+    buffer_len = snprintf(buffer, sizeof(buffer), "%lldcm\n", distance_cm);
+
+    to_copy = min(len, (size_t)(buffer_len + 1));
+
+    hcsr04_latency_account(record.timestamp_ns);
+
+    not_copied = copy_to_user(user_buffer, buffer, to_copy);
+    
+    if (not_copied > 0) 
+        return -EFAULT;
+
+    *off += to_copy;
+
+    return to_copy;
+}
+
+/*
+ *	The servo expects a 50 Hz signal whose pulse width (servo_min_us .. servo_max_us) sets the angle.
+ *	pwm_apply_might_sleep() programs period, duty cycle and enable state in one go.
+ */
+
+static int hcsr04_servo_set(unsigned int deg) {
+	struct pwm_state state;
+	int err;
+
+	pwm_init_state(servo, &state);
+	state.period = SERVO_PERIOD_NS;
+	state.duty_cycle = (servo_min_us + (servo_max_us - servo_min_us) * deg / SERVO_MAX_DEG) * NSEC_PER_USEC;
+	state.enabled = true;
+
+	err = pwm_apply_might_sleep(servo, &state);
+
+	/* The angle the engine files its samples under for the sector minimum */
+	if (!err)
+		WRITE_ONCE(hcsr04.servo_deg, deg);
+
+	return err;
+}
+
+/*
+ *	A whole sweep runs inside one ioctl: every position is a servo move, the settle delay and a ping, and the records are copied to
+ *	user space as they are produced. User space no longer pays a system call and a wakeup for every servo step. scan_lock keeps
+ *	concurrent sweeps from moving the servo under each other's samples.
+ */
+
+static long hcsr04_scan(struct hcsr04_scan __user *uscan) {
+	struct hcsr04_scan scan;
+	struct hcsr04_scan_record record;
+	struct hcsr04_scan_record __user *records;
+	int angle, step, steps, i, err = 0;
+	struct hcsr04_record sample;
+
+	if (!servo)
+		return -ENODEV;
+
+	if (copy_from_user(&scan, uscan, sizeof(scan)))
+		return -EFAULT;
+
+	if (scan.start_deg > SERVO_MAX_DEG || scan.end_deg > SERVO_MAX_DEG || !scan.step_deg)
+		return -EINVAL;
+
+	steps = abs((int)scan.end_deg - (int)scan.start_deg) / scan.step_deg + 1;
+
+	if (scan.count < steps)
+		return -EINVAL;
+
+	step = scan.end_deg >= scan.start_deg ? scan.step_deg : -scan.step_deg;
+	records = u64_to_user_ptr(scan.records);
+
+	if (mutex_lock_interruptible(&hcsr04.scan_lock))
+		return -EINTR;
+
+	for (i = 0, angle = scan.start_deg; i < steps; i++, angle += step) {
+
+		err = hcsr04_servo_set(angle);
+
+		if (err) {
+			pr_err("hcsr04_driver - Error moving the servo to %d degrees\n", angle);
+			goto out;
+		}
+
+		if (scan.settle_ms && msleep_interruptible(scan.settle_ms)) {
+			err = -EINTR;
+			goto out;
+		}
+
+		if (signal_pending(current) || hcsr04_measure(&sample, false)) {
+			err = -EINTR;
+			goto out;
+		}
+
+		memset(&record, 0, sizeof(record));
+		record.timestamp_ns = sample.timestamp_ns;
+		record.angle_deg = angle;
+		record.status = sample.status;
+		record.distance_mm = sample.distance_mm;
+
+		if (copy_to_user(&records[i], &record, sizeof(record))) {
+			err = -EFAULT;
+			goto out;
+		}
+	}
+
+	if (put_user(steps, &uscan->count))
+		err = -EFAULT;
+
+out:
+	mutex_unlock(&hcsr04.scan_lock);
+
+	return err;
+}
+
+static long hcsr04_set_lut(const struct hcsr04_lut __user *ulut) {
+	struct hcsr04_config *cfg;
+	struct hcsr04_lut new_lut;
+	unsigned int i;
+
+	if (copy_from_user(&new_lut, ulut, sizeof(new_lut)))
+		return -EFAULT;
+
+	if (new_lut.count == 1 || new_lut.count > HCSR04_LUT_MAX)
+		return -EINVAL;
+
+	for (i = 1; i < new_lut.count; i++) {
+		if (new_lut.points[i].raw_mm <= new_lut.points[i - 1].raw_mm)
+			return -EINVAL;
+	}
+
+	cfg = hcsr04_config_begin();
+
+	if (!cfg)
+		return -ENOMEM;
+
+	cfg->lut = new_lut;
+	hcsr04_config_commit(cfg);
+
+	return 0;
+}
+
+static long hcsr04_get_lut(struct hcsr04_lut __user *ulut) {
+	struct hcsr04_lut cur_lut;
+
+	rcu_read_lock();
+	cur_lut = rcu_dereference(hcsr04.config)->lut;
+	rcu_read_unlock();
+
+	if (copy_to_user(ulut, &cur_lut, sizeof(cur_lut)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ *	Collects raw distances for calibration against a target the user placed at a known distance. The median is returned
+ *	besides the sum, so a few stray echoes do not move the fit.
+ */
+
+static long hcsr04_cal_collect(struct hcsr04_cal_collect __user *ucal) {
+	struct hcsr04_cal_collect cal;
+	u32 *values;
+	s64 echo_ns, raw_mm;
+	unsigned int i, max_mm;
+	u64 end_ns;
+	long err = 0;
+
+	if (copy_from_user(&cal, ucal, sizeof(cal)))
+		return -EFAULT;
+
+	if (!cal.samples || cal.samples > HCSR04_CAL_MAX_SAMPLES || cal.interval_ms > HCSR04_CAL_MAX_INTERVAL_MS)
+		return -EINVAL;
+
+	/* Calibration needs its own pings at its own interval */
+	if (READ_ONCE(hcsr04.engine))
+		return -EBUSY;
+
+	values = kmalloc_array(cal.samples, sizeof(*values), GFP_KERNEL);
+
+	if (!values)
+		return -ENOMEM;
+
+	cal.valid = 0;
+	cal.sum_mm = 0;
+	max_mm = hcsr04_config_read(max_distance_mm);
+
+	for (i = 0; i < cal.samples; i++) {
+
+		if ((i && cal.interval_ms && msleep_interruptible(cal.interval_ms)) || signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+
+		echo_ns = hcsr04_ping(false, &end_ns);
+
+		if (echo_ns == -EINTR || echo_ns == -EAGAIN) {
+			err = echo_ns == -EINTR ? -EINTR : -EBUSY;
+			goto out;
+		}
+
+		if (echo_ns < 0)
+			continue;
+
+		raw_mm = hcsr04_echo_to_raw_mm(echo_ns);
+
+		if (raw_mm > max_mm)
+			continue;
+
+		values[cal.valid++] = raw_mm;
+		cal.sum_mm += raw_mm;
+	}
+
+	if (!cal.valid) {
+		err = -ETIMEDOUT;
+		goto out;
+	}
+
+	sort(values, cal.valid, sizeof(*values), cmp_u32, NULL);
+
+	cal.min_mm = values[0];
+	cal.max_mm = values[cal.valid - 1];
+	cal.median_mm = values[cal.valid / 2];
+
+	if (copy_to_user(ucal, &cal, sizeof(cal)))
+		err = -EFAULT;
+
+out:
+	kfree(values);
+
+	return err;
+}
+
+/*
+ *	Priority request: one fresh sample as soon as the ping in flight (if any) and the guard time allow, ahead of every other reader.
+ *	The achieved latency is measured from the ioctl entry to the echo end.
+ */
+
+static long hcsr04_fresh(struct hcsr04_fresh __user *ufresh) {
+	struct hcsr04_fresh fresh;
+	u64 start_ns = ktime_get_ns();
+	int err;
+
+	if (copy_from_user(&fresh, ufresh, sizeof(fresh)))
+		return -EFAULT;
+
+	err = hcsr04_measure(&fresh.record, true);
+
+	if (err)
+		return err;
+
+	fresh.latency_ns = min_t(u64, fresh.record.timestamp_ns - start_ns, U32_MAX);
+	fresh.met = !fresh.record.status && fresh.latency_ns <= (u64)fresh.deadline_us * NSEC_PER_USEC;
+
+	if (!fresh.record.status)
+		fresh.record.latency_ns = hcsr04_latency_account(fresh.record.timestamp_ns);
+
+	if (copy_to_user(ufresh, &fresh, sizeof(fresh)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ *	Stream readers are on the engine's stream_list for as long as they are in HCSR04_FORMAT_STREAM. ASYNC and STREAM share the
+ *	results fifo: an ASYNC reader cannot leave the format while pings are pending or results are uncollected (EBUSY), a submitted
+ *	ping's result is never dropped. Stream samples left in the fifo are discarded when a reader leaves STREAM.
+ */
+
+static int hcsr04_set_format(struct hcsr04_reader *reader, u32 format) {
+	unsigned long flags;
+	int err = 0;
+
+	spin_lock_irqsave(&hcsr04.engine_lock, flags);
+	spin_lock(&reader->lock);
+
+	if (format == reader->format)
+		goto out;
+
+	if (reader->format == HCSR04_FORMAT_ASYNC && (reader->pending || !kfifo_is_empty(&reader->results))) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	if (reader->format == HCSR04_FORMAT_STREAM) {
+		list_del(&reader->stream);
+		kfifo_reset(&reader->results);
+	}
+	else if (format == HCSR04_FORMAT_STREAM) {
+		list_add_tail(&reader->stream, &hcsr04.stream_list);
+	}
+
+	reader->format = format;
+
+out:
+	spin_unlock(&reader->lock);
+	spin_unlock_irqrestore(&hcsr04.engine_lock, flags);
+
+	return err;
+}
+
+/* The next sample after a change is always delivered, it is the reference for the new deadband */
+
+static long hcsr04_set_deadband(struct hcsr04_reader *reader, const struct hcsr04_deadband __user *udeadband) {
+	struct hcsr04_deadband deadband;
+
+	if (copy_from_user(&deadband, udeadband, sizeof(deadband)))
+		return -EFAULT;
+
+	spin_lock_irq(&reader->lock);
+
+	reader->deadband_mm = deadband.deadband_mm;
+	reader->heartbeat_ms = deadband.heartbeat_ms;
+	reader->delivered = false;
+
+	spin_unlock_irq(&reader->lock);
+
+	return 0;
+}
+
+static long hcsr04_get_sectors(struct hcsr04_sectors __user *usectors) {
+	struct hcsr04_sectors sectors;
+
+	hcsr04_sectors_read(&sectors);
+
+	if (copy_to_user(usectors, &sectors, sizeof(sectors)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long hcsr04_submit(struct hcsr04_reader *reader, struct hcsr04_submit __user *usubmit) {
+	struct hcsr04_submit submit;
+	int err;
+
+	if (copy_from_user(&submit, usubmit, sizeof(submit)))
+		return -EFAULT;
+
+	err = hcsr04_async_submit(reader, submit.count, &submit.first_id);
+
+	if (err)
+		return err;
+
+	if (copy_to_user(usubmit, &submit, sizeof(submit)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long hcsr04_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct hcsr04_reader *reader = filp->private_data;
+
+	switch (cmd) {
+	case HCSR04_IOC_SET_FORMAT:
+		if (arg > HCSR04_FORMAT_SECTORS)
+			return -EINVAL;
+		return hcsr04_set_format(reader, arg);
+	case HCSR04_IOC_SUBMIT:
+		return hcsr04_submit(reader, (struct hcsr04_submit __user *)arg);
+	case HCSR04_IOC_SET_DEADBAND:
+		return hcsr04_set_deadband(reader, (const struct hcsr04_deadband __user *)arg);
+	case HCSR04_IOC_GET_SECTORS:
+		return hcsr04_get_sectors((struct hcsr04_sectors __user *)arg);
+	case HCSR04_IOC_SCAN:
+		return hcsr04_scan((struct hcsr04_scan __user *)arg);
+	case HCSR04_IOC_SET_LUT:
+		return hcsr04_set_lut((const struct hcsr04_lut __user *)arg);
+	case HCSR04_IOC_GET_LUT:
+		return hcsr04_get_lut((struct hcsr04_lut __user *)arg);
+	case HCSR04_IOC_FRESH:
+		return hcsr04_fresh((struct hcsr04_fresh __user *)arg);
+	case HCSR04_IOC_CAL_COLLECT:
+		return hcsr04_cal_collect((struct hcsr04_cal_collect __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ *	Every open file gets its own reader state, so each process can pick its own read format.
+ */
+
+static int hcsr04_open(struct inode *inode, struct file *filp) {
+	struct hcsr04_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+
+	if (!reader)
+		return -ENOMEM;
+
+	spin_lock_init(&reader->lock);
+	init_waitqueue_head(&reader->wq);
+	INIT_WORK(&reader->work, hcsr04_async_work);
+	INIT_KFIFO(reader->results);
+	INIT_LIST_HEAD(&reader->stream);
+	reader->next_id = 1;
+
+	filp->private_data = reader;
+
+	return 0;
+}
+
+/* write() submits split-phase pings, the buffer holds their number as a __u32 */
+
+static ssize_t hcsr04_write(struct file *filp, const char __user *user_buffer, size_t len, loff_t *off) {
+	struct hcsr04_reader *reader = filp->private_data;
+	u32 count, first_id;
+	int err;
+
+	if (len < sizeof(count))
+		return -EINVAL;
+
+	if (copy_from_user(&count, user_buffer, sizeof(count)))
+		return -EFAULT;
+
+	err = hcsr04_async_submit(reader, count, &first_id);
+
+	if (err)
+		return err;
+
+	return sizeof(count);
+}
+
+/* Text and binary reads ping on demand, so they are always readable */
+
+static __poll_t hcsr04_poll(struct file *filp, struct poll_table_struct *wait) {
+	struct hcsr04_reader *reader = filp->private_data;
+
+	if (reader->format == HCSR04_FORMAT_SECTORS) {
+		poll_wait(filp, &hcsr04.sector_wq, wait);
+
+		return READ_ONCE(hcsr04.sectors.cycle) == reader->sectors_seen ? 0 : EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (reader->format != HCSR04_FORMAT_ASYNC && reader->format != HCSR04_FORMAT_STREAM)
+		return EPOLLIN | EPOLLRDNORM;
+
+	poll_wait(filp, &reader->wq, wait);
+
+	return kfifo_is_empty(&reader->results) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static int hcsr04_release(struct inode *inode, struct file *filp) {
+	struct hcsr04_reader *reader = filp->private_data;
+
+	/* Takes a stream reader off the stream_list. For an ASYNC reader with pings in flight it fails, closing stops them below. */
+	hcsr04_set_format(reader, HCSR04_FORMAT_TEXT);
+
+	spin_lock_irq(&reader->lock);
+	reader->closing = true;
+	spin_unlock_irq(&reader->lock);
+
+	cancel_work_sync(&reader->work);
+	kfree(reader);
+
+	return 0;
+}
+
+static struct file_operations fops = {
+	.owner = THIS_MODULE,
+	.open = hcsr04_open,
+	.release = hcsr04_release,
+	.read = get_distance,
+	.write = hcsr04_write,
+	.poll = hcsr04_poll,
+	.unlocked_ioctl = hcsr04_ioctl,
+	.compat_ioctl = compat_ptr_ioctl
+};
+
+/*
+ *	sysfs attributes of the device (/sys/class/hcsr04/hcsr04_1/). They are created together with the device node by
+ *	device_create_with_groups(), so they exist exactly as long as the device does.
+ */
+
+static ssize_t hist_bin_mm_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", hcsr04_config_read(hist_bin_mm));
+}
+
+/* Histogram settings: the new config is published first, then the histogram starts over with it */
+
+static int hcsr04_hist_set(unsigned int bin_mm, unsigned int window_ms) {
+	struct hcsr04_config *cfg;
+	unsigned long flags;
+
+	cfg = hcsr04_config_begin();
+
+	if (!cfg)
+		return -ENOMEM;
+
+	if (bin_mm != UINT_MAX)
+		cfg->hist_bin_mm = bin_mm;
+	if (window_ms != UINT_MAX)
+		cfg->hist_window_ms = window_ms;
+
+	bin_mm = cfg->hist_bin_mm;
+
+	hcsr04_config_commit(cfg);
+
+	spin_lock_irqsave(&hcsr04.hist_lock, flags);
+	hcsr04_hist_reset(&hcsr04.hist_cur, bin_mm, ktime_get_ns());
+	memset(&hcsr04.hist_done, 0, sizeof(hcsr04.hist_done));
+	spin_unlock_irqrestore(&hcsr04.hist_lock, flags);
+
+	return 0;
+}
+
+static ssize_t hist_bin_mm_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int val;
+	int err;
+
+	if (kstrtouint(buf, 0, &val) || val == UINT_MAX)
+		return -EINVAL;
+
+	/* Changing the bin width makes the collected counts meaningless, start over */
+	err = hcsr04_hist_set(val, UINT_MAX);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(hist_bin_mm);
+
+static ssize_t hist_window_ms_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", hcsr04_config_read(hist_window_ms));
+}
+
+static ssize_t hist_window_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int val;
+	int err;
+
+	if (kstrtouint(buf, 0, &val) || val == UINT_MAX)
+		return -EINVAL;
+
+	err = hcsr04_hist_set(UINT_MAX, val);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(hist_window_ms);
+
+/* Echo timeout and largest valid distance, used from the next ping on */
+
+static ssize_t timeout_ms_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", hcsr04_config_read(timeout_ms));
+}
+
+static ssize_t timeout_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hcsr04_config *cfg;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > MSEC_PER_SEC)
+		return -EINVAL;
+
+	/* engine_ctl keeps an hrtimer engine from starting with the old timeout while the new one is published */
+	mutex_lock(&hcsr04.engine_ctl);
+
+	if (hcsr04_engine_check_period(hcsr04.engine, hcsr04.engine_period_us, val, READ_ONCE(ping_guard_us))) {
+		mutex_unlock(&hcsr04.engine_ctl);
+		return -EINVAL;
+	}
+
+	cfg = hcsr04_config_begin();
+
+	if (!cfg) {
+		mutex_unlock(&hcsr04.engine_ctl);
+		return -ENOMEM;
+	}
+
+	cfg->timeout_ms = val;
+	hcsr04_config_commit(cfg);
+
+	mutex_unlock(&hcsr04.engine_ctl);
 
-static dev_t devt;
-static struct cdev hcsr04_cdev;
-static struct class *hcsr04_class;
-static struct device *hcsr04_device;
+	return count;
+}
+static DEVICE_ATTR_RW(timeout_ms);
 
-static int echo_irq, ret;
-static ktime_t start_time, end_time, duration_ns;
-static s64 distance_cm;
+static ssize_t max_distance_mm_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", hcsr04_config_read(max_distance_mm));
+}
 
-static struct gpio_desc *trigger, *echo;
+static ssize_t max_distance_mm_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hcsr04_config *cfg;
+	unsigned int val;
 
-static DECLARE_WAIT_QUEUE_HEAD(echo_wq);
-static bool pulse_ready;
+	if (kstrtouint(buf, 0, &val) || !val)
+		return -EINVAL;
 
-static ssize_t get_distance(struct file *filp, char __user *user_buffer, size_t len, loff_t *off) {
-    char buffer[64];
-    int buffer_len, not_copied, to_copy;
+	cfg = hcsr04_config_begin();
 
-    if (*off > 0) {
-        *off = 0;
-        return 0;
-    }
+	if (!cfg)
+		return -ENOMEM;
 
-    gpiod_set_value(trigger, 1);
-    udelay(10);
-    gpiod_set_value(trigger, 0);
+	cfg->max_distance_mm = val;
+	hcsr04_config_commit(cfg);
 
-	/* 
- 	 *	wait_event_interruptible_timeout() blocks the process until the interrupt handler sets pulse_ready to true or timeout expires.
-	 * 	This avoids busy-waiting and allows other processes to run while we wait for the echo pulse measurement to complete.
-	 */
-	
-    pulse_ready = false;
-    wait_event_interruptible_timeout(echo_wq, pulse_ready, msecs_to_jiffies(TIMEOUT));
+	return count;
+}
+static DEVICE_ATTR_RW(max_distance_mm);
 
-    if (!pulse_ready) 
-        return -ETIMEDOUT;
+/*
+ *	The histogram is copied and reset under the lock, so a read always returns one consistent window and no sample is counted twice
+ *	or lost between two reads. Only reads at offset 0 return data.
+ */
 
-    distance_cm = div64_s64(duration_ns, 58000ULL);
+static ssize_t histogram_read(struct file *filp, struct kobject *kobj, const struct bin_attribute *attr, char *buf, loff_t off, size_t count) {
+	struct hcsr04_histogram *hist = (struct hcsr04_histogram *)buf;
+	unsigned long flags;
+	u64 now;
 
-    if (distance_cm < 0 || distance_cm > 400) {
-        pr_err("hcsr04_driver - distance out of range! value = %lld\n", distance_cm);
-        return -ERANGE;
-    }
+	if (off)
+		return 0;
 
-    buffer_len = snprintf(buffer, sizeof(buffer), "%lldcm\n", distance_cm);
+	if (count < sizeof(*hist))
+		return -EINVAL;
 
-    to_copy = min(len, (size_t)(buffer_len + 1));
+	now = ktime_get_ns();
 
-    not_copied = copy_to_user(user_buffer, buffer, to_copy);
-    
-    if (not_copied > 0) 
-        return -EFAULT;
+	spin_lock_irqsave(&hcsr04.hist_lock, flags);
 
-    *off += to_copy;
+	if (hcsr04_config_read(hist_window_ms)) {
+		*hist = hcsr04.hist_done;
+		memset(&hcsr04.hist_done, 0, sizeof(hcsr04.hist_done));
+	}
+	else {
+		*hist = hcsr04.hist_cur;
+		hist->window_ns = now - hcsr04.hist_cur.window_start_ns;
+		hcsr04_hist_reset(&hcsr04.hist_cur, hcsr04.hist_cur.bin_mm, now);
+	}
 
-    return to_copy;
+	spin_unlock_irqrestore(&hcsr04.hist_lock, flags);
+
+	return sizeof(*hist);
 }
+static const BIN_ATTR_RO(histogram, sizeof(struct hcsr04_histogram));
 
-static struct file_operations fops = {
-	.owner = THIS_MODULE,
-	.read = get_distance
+/*
+ *	latency_hist lists the delivery latency buckets, one "<upper bound in ns> <count>" line per non-empty bucket.
+ *	Writing anything to it clears the counts.
+ */
+
+static ssize_t latency_hist_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	int i, len = 0;
+	s64 count;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		count = atomic64_read(&hcsr04.latency_buckets[i]);
+
+		if (count)
+			len += sysfs_emit_at(buf, len, "%llu %lld\n", 1ULL << i, count);
+	}
+
+	return len;
+}
+
+static ssize_t latency_hist_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		atomic64_set(&hcsr04.latency_buckets[i], 0);
+
+	return count;
+}
+static DEVICE_ATTR_RW(latency_hist);
+
+/*
+ *	dir_switch: last and longest output to input switch time in ns and the number of echoes that started during a switch (single pin mode).
+ */
+
+static ssize_t dir_switch_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%lld %lld %lu\n", hcsr04.dir_switch_ns, hcsr04.dir_switch_max_ns, hcsr04.dir_switch_late);
+}
+static DEVICE_ATTR_RO(dir_switch);
+
+/* Echo edges taken by echo_isr() and edges it suppressed (outside the echo window or out of order) */
+
+static ssize_t echo_edges_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	u64 sum[HCSR04_STAT_COUNT];
+
+	hcsr04_stats_fold(sum);
+
+	return sysfs_emit(buf, "%llu %llu\n", sum[HCSR04_STAT_EDGES], sum[HCSR04_STAT_SUPPRESSED]);
+}
+static DEVICE_ATTR_RO(echo_edges);
+
+/* All statistics, one "name value" line each */
+
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	u64 sum[HCSR04_STAT_COUNT];
+	int i, len = 0;
+
+	hcsr04_stats_fold(sum);
+
+	for (i = 0; i < HCSR04_STAT_COUNT; i++)
+		len += sysfs_emit_at(buf, len, "%s %llu\n", hcsr04_stat_names[i], sum[i]);
+
+	return len;
+}
+static DEVICE_ATTR_RO(stats);
+
+/* Edge timestamp clock, applied from the next ping on. The list shows the selected one in brackets. */
+
+static ssize_t clock_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	int i, len = 0, clock = hcsr04_config_read(clock);
+
+	for (i = 0; i < ARRAY_SIZE(hcsr04_clock_names); i++)
+		len += sysfs_emit_at(buf, len, i == clock ? "%s[%s]" : "%s%s", i ? " " : "", hcsr04_clock_names[i]);
+
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t clock_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hcsr04_config *cfg;
+	u64 mult = 0;
+	int clock, err;
+
+	clock = sysfs_match_string(hcsr04_clock_names, buf);
+
+	if (clock < 0)
+		return clock;
+
+	if (clock == HCSR04_CLOCK_CYCLES) {
+		err = hcsr04_cycles_calibrate(&mult);
+
+		if (err)
+			return err;
+	}
+
+	cfg = hcsr04_config_begin();
+
+	if (!cfg)
+		return -ENOMEM;
+
+	cfg->clock = clock;
+	cfg->cycles_mult = mult;
+	hcsr04_config_commit(cfg);
+
+	return count;
+}
+static DEVICE_ATTR_RW(clock);
+
+/*
+ *	Cost and resolution of every clock on this machine, one line each: "name cost_ns resolution_ns". The cost is the average of
+ *	CLOCK_BENCH_LOOPS back to back reads, the resolution the smallest step seen between them (0 if the clock never moved).
+ *	The cycles line calibrates the counter rate for its own use.
+ */
+
+#define CLOCK_BENCH_LOOPS 1000
+
+static ssize_t clock_bench_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	u64 t0, t1, prev, now, res, mult = 0;
+	int clock, i, len = 0;
+
+	for (clock = 0; clock < ARRAY_SIZE(hcsr04_clock_names); clock++) {
+
+		if (clock == HCSR04_CLOCK_CYCLES) {
+			if (hcsr04_cycles_calibrate(&mult)) {
+				len += sysfs_emit_at(buf, len, "%s - -\n", hcsr04_clock_names[clock]);
+				continue;
+			}
+		}
+
+		res = U64_MAX;
+
+		preempt_disable();
+
+		t0 = ktime_get_ns();
+		prev = hcsr04_clock_read(clock);
+
+		for (i = 0; i < CLOCK_BENCH_LOOPS; i++) {
+			now = hcsr04_clock_read(clock);
+
+			if (now != prev)
+				res = min(res, now - prev);
+
+			prev = now;
+		}
+
+		t1 = ktime_get_ns();
+
+		preempt_enable();
+
+		len += sysfs_emit_at(buf, len, "%s %llu %llu\n", hcsr04_clock_names[clock], div_u64(t1 - t0, CLOCK_BENCH_LOOPS),
+				     res == U64_MAX ? 0 : hcsr04_clock_to_ns(clock, mult, res));
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(clock_bench);
+
+/* Sampling engine and its grid: period, phase and clock. Changing the grid restarts a running engine. */
+
+static ssize_t engine_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	int i, len = 0, engine = READ_ONCE(hcsr04.engine);
+
+	for (i = 0; i < ARRAY_SIZE(hcsr04_engine_names); i++)
+		len += sysfs_emit_at(buf, len, i == engine ? "%s[%s]" : "%s%s", i ? " " : "", hcsr04_engine_names[i]);
+
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t engine_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	int engine, err = 0;
+
+	engine = sysfs_match_string(hcsr04_engine_names, buf);
+
+	if (engine < 0)
+		return engine;
+
+	mutex_lock(&hcsr04.engine_ctl);
+
+	hcsr04_engine_stop();
+
+	if (engine != ENGINE_NONE)
+		err = hcsr04_engine_start(engine);
+
+	mutex_unlock(&hcsr04.engine_ctl);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(engine);
+
+static ssize_t period_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", READ_ONCE(hcsr04.engine_period_us));
+}
+
+/* Sets one of the grid fields. The phase has to stay below the period, and a running hrtimer engine keeps its period check. */
+
+static int hcsr04_engine_set_grid(unsigned int *field, unsigned int val) {
+	unsigned int old = *field;
+	int engine, err = 0;
+
+	mutex_lock(&hcsr04.engine_ctl);
+
+	WRITE_ONCE(*field, val);
+
+	if (hcsr04.engine_phase_us >= hcsr04.engine_period_us ||
+	    hcsr04_engine_check_period(hcsr04.engine, hcsr04.engine_period_us, hcsr04_config_read(timeout_ms), READ_ONCE(ping_guard_us))) {
+		WRITE_ONCE(*field, old);
+		mutex_unlock(&hcsr04.engine_ctl);
+		return -EINVAL;
+	}
+
+	engine = hcsr04.engine;
+	hcsr04_engine_stop();
+
+	if (engine != ENGINE_NONE)
+		err = hcsr04_engine_start(engine);
+
+	mutex_unlock(&hcsr04.engine_ctl);
+
+	return err;
+}
+
+static ssize_t period_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int val;
+	int err;
+
+	if (kstrtouint(buf, 0, &val) || val < ENGINE_MIN_PERIOD_US)
+		return -EINVAL;
+
+	err = hcsr04_engine_set_grid(&hcsr04.engine_period_us, val);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(period_us);
+
+static ssize_t phase_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", READ_ONCE(hcsr04.engine_phase_us));
+}
+
+static ssize_t phase_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int val;
+	int err;
+
+	if (kstrtouint(buf, 0, &val))
+		return -EINVAL;
+
+	err = hcsr04_engine_set_grid(&hcsr04.engine_phase_us, val);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(phase_us);
+
+static ssize_t engine_clock_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	int i, len = 0, clock = READ_ONCE(hcsr04.engine_clock);
+
+	for (i = 0; i < ARRAY_SIZE(hcsr04_engine_clock_names); i++)
+		len += sysfs_emit_at(buf, len, i == clock ? "%s[%s]" : "%s%s", i ? " " : "", hcsr04_engine_clock_names[i]);
+
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t engine_clock_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	int clock, err;
+
+	clock = sysfs_match_string(hcsr04_engine_clock_names, buf);
+
+	if (clock < 0)
+		return clock;
+
+	err = hcsr04_engine_set_grid(&hcsr04.engine_clock, clock);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(engine_clock);
+
+/* Tick statistics of the running engine since it started, for comparing the engines on a board */
+
+static ssize_t engine_stats_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	u64 ticks = READ_ONCE(hcsr04.engine_ticks);
+	u64 per_tick = max_t(u64, ticks, 1);
+
+	return sysfs_emit(buf, "ticks %llu\noverruns %llu\njitter_avg_ns %llu\njitter_max_ns %llu\ncost_avg_ns %llu\n",
+			  ticks, READ_ONCE(hcsr04.engine_overruns), div64_u64(READ_ONCE(hcsr04.engine_jitter_sum_ns), per_tick),
+			  READ_ONCE(hcsr04.engine_jitter_max_ns), div64_u64(atomic64_read(&hcsr04.engine_cost_ns), per_tick));
+}
+static DEVICE_ATTR_RO(engine_stats);
+
+/* Sensor health as scored by the engine. Yield is the share of ticks that delivered a valid sample. */
+
+static ssize_t health_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	unsigned int health = READ_ONCE(hcsr04.engine_health);
+	u64 ticks = max_t(u64, READ_ONCE(hcsr04.engine_ticks), 1);
+
+	return sysfs_emit(buf, "health_pct %u\nparked %d\nyield_pct %llu\nvalid %llu\nskipped %llu\n",
+			  health * 100 / HEALTH_ONE, health * 100 < READ_ONCE(hcsr04.engine_health_min) * HEALTH_ONE,
+			  div64_u64(READ_ONCE(hcsr04.engine_valid) * 100, ticks), READ_ONCE(hcsr04.engine_valid),
+			  READ_ONCE(hcsr04.engine_skipped));
+}
+static DEVICE_ATTR_RO(health);
+
+/* Health in percent below which the engine parks the sensor, 0 never parks it. Above 50 a valid probe could not unpark it. */
+
+static ssize_t health_min_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", READ_ONCE(hcsr04.engine_health_min));
+}
+
+static ssize_t health_min_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > 50)
+		return -EINVAL;
+
+	WRITE_ONCE(hcsr04.engine_health_min, val);
+
+	return count;
+}
+static DEVICE_ATTR_RW(health_min);
+
+/* Sector angle ranges as "start-end" pairs, and the number of engine samples per cycle. Changing them starts a new cycle. */
+
+static ssize_t sectors_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	const struct hcsr04_config *cfg;
+	unsigned int i;
+	int len = 0;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(hcsr04.config);
+
+	for (i = 0; i < cfg->nsectors; i++)
+		len += sysfs_emit_at(buf, len, "%s%u-%u", i ? " " : "", cfg->sectors[i].start_deg, cfg->sectors[i].end_deg);
+
+	rcu_read_unlock();
+
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t sectors_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hcsr04_config *cfg;
+	unsigned int start, end, i = 0;
+	u16 ranges[HCSR04_SECTORS_MAX][2];
+	const char *p = buf;
+	int n;
+
+	while (sscanf(p, " %u-%u%n", &start, &end, &n) == 2) {
+
+		if (i == HCSR04_SECTORS_MAX || start > end || end > SERVO_MAX_DEG)
+			return -EINVAL;
+
+		ranges[i][0] = start;
+		ranges[i][1] = end;
+		i++;
+		p += n;
+	}
+
+	if (!i || !sysfs_streq(p, ""))
+		return -EINVAL;
+
+	cfg = hcsr04_config_begin();
+
+	if (!cfg)
+		return -ENOMEM;
+
+	cfg->nsectors = i;
+
+	while (i--) {
+		cfg->sectors[i].start_deg = ranges[i][0];
+		cfg->sectors[i].end_deg = ranges[i][1];
+	}
+
+	hcsr04_config_commit(cfg);
+
+	spin_lock_irq(&hcsr04.engine_lock);
+	hcsr04_sectors_clear();
+	spin_unlock_irq(&hcsr04.engine_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(sectors);
+
+static ssize_t sector_cycle_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%u\n", hcsr04_config_read(sector_cycle));
+}
+
+static ssize_t sector_cycle_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hcsr04_config *cfg;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val)
+		return -EINVAL;
+
+	cfg = hcsr04_config_begin();
+
+	if (!cfg)
+		return -ENOMEM;
+
+	cfg->sector_cycle = val;
+	hcsr04_config_commit(cfg);
+
+	spin_lock_irq(&hcsr04.engine_lock);
+	hcsr04_sectors_clear();
+	spin_unlock_irq(&hcsr04.engine_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(sector_cycle);
+
+/* Last published cycle: one line per sector with its number, minimum and angle, "-" for a sector without a valid sample */
+
+static ssize_t sector_min_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hcsr04_sectors sectors;
+	unsigned int i;
+	int len;
+
+	hcsr04_sectors_read(&sectors);
+
+	len = sysfs_emit(buf, "cycle %u\n", sectors.cycle);
+
+	for (i = 0; i < sectors.count; i++) {
+		if (sectors.sectors[i].status)
+			len += sysfs_emit_at(buf, len, "%u -\n", i);
+		else
+			len += sysfs_emit_at(buf, len, "%u %u %u\n", i, sectors.sectors[i].min_mm, sectors.sectors[i].angle_deg);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(sector_min);
+
+static struct attribute *hcsr04_attrs[] = {
+	&dev_attr_hist_bin_mm.attr,
+	&dev_attr_hist_window_ms.attr,
+	&dev_attr_timeout_ms.attr,
+	&dev_attr_max_distance_mm.attr,
+	&dev_attr_latency_hist.attr,
+	&dev_attr_dir_switch.attr,
+	&dev_attr_echo_edges.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_clock.attr,
+	&dev_attr_clock_bench.attr,
+	&dev_attr_engine.attr,
+	&dev_attr_period_us.attr,
+	&dev_attr_phase_us.attr,
+	&dev_attr_engine_clock.attr,
+	&dev_attr_engine_stats.attr,
+	&dev_attr_health.attr,
+	&dev_attr_health_min.attr,
+	&dev_attr_sectors.attr,
+	&dev_attr_sector_cycle.attr,
+	&dev_attr_sector_min.attr,
+	NULL
+};
+
+static const struct bin_attribute *const hcsr04_bin_attrs[] = {
+	&bin_attr_histogram,
+	NULL
+};
+
+static const struct attribute_group hcsr04_group = {
+	.attrs = hcsr04_attrs,
+	.bin_attrs = hcsr04_bin_attrs
+};
+
+static const struct attribute_group *hcsr04_groups[] = {
+	&hcsr04_group,
+	NULL
 };
 
 static irqreturn_t echo_isr(int irq, void *dev_id) {
 
+	u64 stamp = hcsr04_clock_read(hcsr04.ping_clock), end_ns;
 	uint8_t value = gpiod_get_value(echo);
+	s64 echo_ns;
+	bool extra;
 
 	/*
 	 * 	After trigger pulse, echo pin goes HIGH when ultrasonic burst starts. Echo pin goes low when reflected signal returns.
 	 *	The pulse duration is equal to the difference between the time at the end of the pulse and the time at the start of it.
-	 *	ktime_get() function gets the exact time in nanoseconds.
+	 *	The edge time is taken first thing, in the clock selected for this ping; hcsr04_gpio_wait() does the conversion to ns.
 	 */
 
-	if (value) {
-		start_time = ktime_get();
+	if (value && hcsr04.echo_state == ECHO_WAIT_RISE) {
+		hcsr04.start_stamp = stamp;
+		hcsr04.echo_state = ECHO_WAIT_FALL;
 	}
-	else {
-		end_time = ktime_get();
+	else if (!value && hcsr04.echo_state == ECHO_WAIT_FALL) {
+		hcsr04.end_stamp = stamp;
+
+		hcsr04.echo_state = ECHO_IDLE;
+
+		/* Read before disarming: once disarmed, the engine may start the next ping (and set ping_extra for it) at any time */
+		extra = hcsr04.ping_extra;
+
+		/*
+		 *	A ping that already ended as a timeout is not completed again. The handler is never threaded, so on PREEMPT_RT it
+		 *	must not take a spinlock_t: pings of the hrtimer engines are committed from engine_echo_work (extra pings from
+		 *	engine_extra_work), and the waiter of a normal ping is on a simple wait queue, which uses a raw spinlock.
+		 */
+
+		if (hcsr04_echo_disarm()) {
+			if (hcsr04.ping_async) {
+				echo_ns = hcsr04_gpio_result(&end_ns);
+
+				raw_spin_lock(&hcsr04.engine_trigger_lock);
 
-		duration_ns = ktime_to_ns(ktime_sub(end_time, start_time));
+				hcsr04.engine_ping_end = hcsr04_engine_now();
 
-		pulse_ready = true;
-		wake_up_interruptible(&echo_wq);
+				if (extra) {
+					hcsr04_engine_extra_done(echo_ns, end_ns);
+				}
+				else {
+					WRITE_ONCE(hcsr04.engine_echo_ns, echo_ns);
+					WRITE_ONCE(hcsr04.engine_echo_end_ns, end_ns);
+					irq_work_queue(&hcsr04.engine_echo_work);
+
+					/* A priority request waiting for this ping can go after the guard instead of after the full timeout */
+					if (hcsr04.engine_extra == EXTRA_WAITING)
+						hrtimer_start(&hcsr04.engine_extra_timer,
+							      ktime_add_us(hcsr04.engine_ping_end, READ_ONCE(ping_guard_us)),
+							      hcsr04_engine_timer_mode(hcsr04.engine));
+				}
+
+				raw_spin_unlock(&hcsr04.engine_trigger_lock);
+
+				atomic64_add(hcsr04_clock_to_ns(hcsr04.ping_clock, hcsr04.ping_mult, hcsr04_clock_read(hcsr04.ping_clock) - stamp),
+					     &hcsr04.engine_cost_ns);
+			}
+			else {
+				hcsr04.pulse_ready = true;
+				swake_up_one(&hcsr04.echo_wq);
+			}
+		}
+	}
+	else {
+		hcsr04_stat_inc(HCSR04_STAT_SUPPRESSED);
+		return IRQ_HANDLED;
 	}
 
+	hcsr04_stat_inc(HCSR04_STAT_EDGES);
+
 	return IRQ_HANDLED;
 }
 
 static int __init hcsr04_init(void) {
+	struct hcsr04_config *cfg;
+	int i, cpu;
 
-	trigger = gpio_to_desc(TRIGGER_PIN + OFFSET_PIN);
-
-	if (!trigger) {
-		pr_err("hcsr04_driver - Error getting pin 4\n");
-		return -ENODEV;
+	for (i = 0; i < ARRAY_SIZE(hcsr04_backends); i++) {
+		if (sysfs_streq(backend, hcsr04_backends[i].name))
+			hcsr04_backend = &hcsr04_backends[i];
 	}
 
-	echo = gpio_to_desc(ECHO_PIN + OFFSET_PIN);
-
-	if (!echo) {
-		pr_err("hcsr04_driver - Error getting pin 3\n");
-		return -ENODEV;
+	if (!hcsr04_backend) {
+		pr_err("hcsr04_driver - Unknown backend %s\n", backend);
+		return -EINVAL;
 	}
 
-	ret = gpiod_direction_output(trigger, 0);
+	/*
+	 *	The IRQ hot part of struct hcsr04_dev must stay within one cache line. Lock debugging makes the wait queue too big for
+	 *	that, and machines with 32 byte lines cannot hold it anyway, so the check only applies without them.
+	 */
 
-	if (ret) {
-		pr_err("hcsr04_driver - Error setting pin 4 to output\n");
-		return ret;
-	}
+	BUILD_BUG_ON(SMP_CACHE_BYTES >= 64 && !IS_ENABLED(CONFIG_DEBUG_SPINLOCK) && !IS_ENABLED(CONFIG_DEBUG_LOCK_ALLOC) &&
+		     offsetofend(struct hcsr04_dev, pulse_ready) - offsetof(struct hcsr04_dev, start_stamp) > SMP_CACHE_BYTES);
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && offsetof(struct hcsr04_dev, ping_lock) % SMP_CACHE_BYTES);
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && offsetof(struct hcsr04_dev, echo_irq) % SMP_CACHE_BYTES);
 
-	ret = gpiod_direction_input(echo);
+	init_swait_queue_head(&hcsr04.echo_wq);
+	mutex_init(&hcsr04.ping_lock);
+	init_waitqueue_head(&hcsr04.ping_wq);
+	spin_lock_init(&hcsr04.hist_lock);
+	mutex_init(&hcsr04.config_lock);
+	mutex_init(&hcsr04.scan_lock);
+	spin_lock_init(&hcsr04.engine_lock);
+	init_waitqueue_head(&hcsr04.engine_wq);
+	INIT_LIST_HEAD(&hcsr04.stream_list);
+	init_irq_work(&hcsr04.engine_timeout_work, hcsr04_engine_timeout_fn);
+	init_irq_work(&hcsr04.engine_echo_work, hcsr04_engine_echo_fn);
+	raw_spin_lock_init(&hcsr04.engine_trigger_lock);
+	init_irq_work(&hcsr04.engine_extra_work, hcsr04_engine_extra_work_fn);
+	hcsr04.engine_period_us = 100000;
+	hcsr04.engine_health = HEALTH_ONE;
+	hcsr04.engine_health_min = 25;
+	seqcount_spinlock_init(&hcsr04.sector_seqcount, &hcsr04.engine_lock);
+	init_waitqueue_head(&hcsr04.sector_wq);
+	hcsr04_sectors_clear();
 
-	if (ret) {
-		pr_err("hcsr04_driver - Error setting pin 3 to input\n");
-		return ret;
-	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(&hcsr04_stats, cpu)->syncp);
 
-	echo_irq = gpiod_to_irq(echo);
+	cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
 
-	if (echo_irq < 0) {
-		pr_err("hcsr04_driver - Error getting an IRQ number for the ECHO pin\n");
-		return echo_irq;
-	}
+	if (!cfg)
+		return -ENOMEM;
+
+	cfg->timeout_ms = TIMEOUT;
+	cfg->max_distance_mm = MAX_DISTANCE_MM;
+	cfg->nsectors = 1;
+	cfg->sectors[0].end_deg = SERVO_MAX_DEG;
+	cfg->sector_cycle = 10;
+	RCU_INIT_POINTER(hcsr04.config, cfg);
 
-	ret = request_irq(echo_irq, echo_isr, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "echo_irq_handler", NULL);
+	ret = hcsr04_backend->init();
 
 	if (ret) {
-		pr_err("hcsr04_driver - Error registering an IRQ for the ECHO pin\n");
-		goto err_free_irq;
+		kfree(cfg);
+		return ret;
 	}
 
-	init_waitqueue_head(&echo_wq);
-
 	/*
 	 *	The next function allocates the major and minor number for the new device. It takes four parameters: (dev_t *dev, unsigned baseminor, unsigned count, const char *name))
 	 *		- *dev: the kernel uses this pointer to return the major and minor number reserved
@@ -167,7 +3180,7 @@ static int __init hcsr04_init(void) {
 	
 	if (ret < 0) {
 		pr_err("hcsr04_driver - Error reserving major and minor numbers for the character device\n");
-		goto err_free_irq;
+		goto err_backend_exit;
 	}
 
 	/*
@@ -204,9 +3217,10 @@ static int __init hcsr04_init(void) {
 	 *		 devt: major and minor numbers reserved
 	 *		*drvdata: private data associated to the device (NULL in this case)
 	 *		*fmt, ...: name of the character device file that will be shown in /dev 
+	 *	device_create_with_groups() does the same and also creates our sysfs attributes before the device is announced to user space.
 	 */
 
-	hcsr04_device = device_create(hcsr04_class, NULL, devt, NULL, DEVICE_NAME);
+	hcsr04_device = device_create_with_groups(hcsr04_class, NULL, devt, NULL, hcsr04_groups, DEVICE_NAME);
 
 	if(IS_ERR(hcsr04_device)) {
 		pr_err("hcsr04_driver - Error creating the character device file\n");
@@ -214,39 +3228,79 @@ static int __init hcsr04_init(void) {
 		goto err_class_destroy;
 	}
 
-	pr_info("hcsr04_driver %d - Driver initialized succesfully\n", MAJOR(devt));
+	/*
+	 *	The scanning servo is optional. pwm_add_table() registers a board-file style lookup that binds the PWM channel to our device,
+	 *	so pwm_get() can find it without a device tree. A missing PWM only disables scanning.
+	 */
+
+	if (servo_pwm) {
+		servo_lookup.provider = servo_pwm;
+		servo_lookup.index = servo_channel;
+		servo_lookup.dev_id = DEVICE_NAME;
+		servo_lookup.con_id = "servo";
+		servo_lookup.period = SERVO_PERIOD_NS;
+		servo_lookup.polarity = PWM_POLARITY_NORMAL;
+		pwm_add_table(&servo_lookup, 1);
+
+		servo = pwm_get(hcsr04_device, "servo");
+
+		if (IS_ERR(servo)) {
+			pr_err("hcsr04_driver - Error getting the servo PWM, scanning disabled\n");
+			pwm_remove_table(&servo_lookup, 1);
+			servo = NULL;
+		}
+	}
+
+	pr_info("hcsr04_driver %d - Driver initialized succesfully (%s backend)\n", MAJOR(devt), hcsr04_backend->name);
 
 	return 0;
 
 	/* ~ Tags for handling errors ~ */
 	
-	err_free_irq:
-		free_irq(echo_irq, NULL);
+	err_backend_exit:
+		hcsr04_backend->exit();
+		kfree(cfg);
 		return ret;
 	err_unregister_chrdev_region:
 		unregister_chrdev_region(devt, 1);
-		free_irq(echo_irq, NULL);
+		hcsr04_backend->exit();
+		kfree(cfg);
 		return ret;
 	err_cdev_del:
 		cdev_del(&hcsr04_cdev);
 		unregister_chrdev_region(devt, 1);
-		free_irq(echo_irq, NULL);
+		hcsr04_backend->exit();
+		kfree(cfg);
 		return ret;
 	err_class_destroy:
 		class_destroy(hcsr04_class);
 		cdev_del(&hcsr04_cdev);
 		unregister_chrdev_region(devt, 1);
-		free_irq(echo_irq, NULL);
+		hcsr04_backend->exit();
+		kfree(cfg);
 		return ret;	
 }
 
 static void __exit hcsr04_exit(void) {
 
+	if (servo) {
+		pwm_disable(servo);
+		pwm_put(servo);
+		pwm_remove_table(&servo_lookup, 1);
+	}
+
+	/* Removing the device removes its attributes and waits for running stores, nothing can start the engine after that */
 	device_destroy(hcsr04_class, devt);
+
+	mutex_lock(&hcsr04.engine_ctl);
+	hcsr04_engine_stop();
+	mutex_unlock(&hcsr04.engine_ctl);
+
 	class_destroy(hcsr04_class);
 	cdev_del(&hcsr04_cdev);
 	unregister_chrdev_region(devt, 1);
-	free_irq(echo_irq, NULL);
+	hcsr04_backend->exit();
+	kfree(rcu_dereference_protected(hcsr04.config, true));
 	
 	pr_info("hcsr04_driver - Driver removed\n");
 
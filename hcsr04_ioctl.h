@@ -0,0 +1,209 @@
+#ifndef HCSR04_IOCTL_H
+#define HCSR04_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ *	ioctl interface of /dev/hcsr04_1, shared by the driver and user space (src/).
+ */
+
+#define HCSR04_IOC_MAGIC 'h'
+
+/*
+ *	Servo scan: the servo is moved from start_deg to end_deg (either direction) in steps of step_deg,
+ *	waiting settle_ms after each move before pinging. One record per position is written to the
+ *	user buffer at records, which must hold count records. On return count is the number written.
+ */
+
+struct hcsr04_scan {
+	__u16 start_deg;
+	__u16 end_deg;
+	__u16 step_deg;
+	__u16 settle_ms;
+	__u32 count;
+	__u32 reserved;
+	__u64 records;
+};
+
+struct hcsr04_scan_record {
+	__u64 timestamp_ns;		/* ktime_get() time of the echo end */
+	__u16 angle_deg;
+	__u16 status;			/* 0, ETIMEDOUT, ERANGE or EIO as in struct hcsr04_record */
+	__u32 distance_mm;
+};
+
+#define HCSR04_IOC_SCAN		_IOWR(HCSR04_IOC_MAGIC, 1, struct hcsr04_scan)
+
+/*
+ *	Calibration table: the raw distance computed from the echo (raw_mm) is mapped to the corrected distance (cal_mm) by linear
+ *	interpolation between the two surrounding points, and by extending the first or last segment outside the table.
+ *	raw_mm must be strictly increasing. A count of 0 removes the table.
+ */
+
+#define HCSR04_LUT_MAX 32
+
+struct hcsr04_lut_point {
+	__u32 raw_mm;
+	__u32 cal_mm;
+};
+
+struct hcsr04_lut {
+	__u32 count;
+	__u32 reserved;
+	struct hcsr04_lut_point points[HCSR04_LUT_MAX];
+};
+
+#define HCSR04_IOC_SET_LUT	_IOW(HCSR04_IOC_MAGIC, 2, struct hcsr04_lut)
+#define HCSR04_IOC_GET_LUT	_IOR(HCSR04_IOC_MAGIC, 3, struct hcsr04_lut)
+
+/*
+ *	Calibration collection: takes samples pings interval_ms apart and returns statistics of the uncalibrated distances
+ *	(the calibration table is not applied). valid is the number of pings that produced a distance. The fit itself is done in
+ *	user space (src/hcsr04_cal.c), the result is loaded with HCSR04_IOC_SET_LUT. A signal aborts the collection with EINTR.
+ */
+
+#define HCSR04_CAL_MAX_SAMPLES 256
+#define HCSR04_CAL_MAX_INTERVAL_MS 1000
+
+struct hcsr04_cal_collect {
+	__u32 samples;
+	__u32 interval_ms;
+	__u32 valid;
+	__u32 min_mm;
+	__u32 max_mm;
+	__u32 median_mm;
+	__u64 sum_mm;
+};
+
+#define HCSR04_IOC_CAL_COLLECT	_IOWR(HCSR04_IOC_MAGIC, 4, struct hcsr04_cal_collect)
+
+/*
+ *	Read format of an open file. In HCSR04_FORMAT_TEXT (the default) every read() pings once and returns "123cm\n".
+ *	In HCSR04_FORMAT_BINARY a read() pings once per struct hcsr04_record that fits in the buffer and returns them all.
+ *	In HCSR04_FORMAT_ASYNC read() does not ping, it collects the results of pings submitted before (see HCSR04_IOC_SUBMIT).
+ *	In HCSR04_FORMAT_STREAM read() returns every sample of the sampling engine (sysfs engine) as a struct hcsr04_async_record
+ *	whose id is the engine's sample number; like in HCSR04_FORMAT_ASYNC it blocks or fails with EAGAIN, and poll() works.
+ *	If the reader falls HCSR04_ASYNC_MAX samples behind, the oldest ones are dropped. Leaving HCSR04_FORMAT_STREAM discards the
+ *	samples not read yet; leaving HCSR04_FORMAT_ASYNC fails with EBUSY while pings are pending or results are not collected.
+ *	In HCSR04_FORMAT_SECTORS read() returns the next sector cycle as a struct hcsr04_sectors (see HCSR04_IOC_GET_SECTORS), blocking
+ *	until there is one the file has not read yet (EAGAIN with O_NONBLOCK); poll() reports POLLIN for a new cycle.
+ *	HCSR04_IOC_SET_FORMAT takes the format as the ioctl argument itself, not a pointer to it.
+ */
+
+#define HCSR04_FORMAT_TEXT	0
+#define HCSR04_FORMAT_BINARY	1
+#define HCSR04_FORMAT_ASYNC	2
+#define HCSR04_FORMAT_STREAM	3
+#define HCSR04_FORMAT_SECTORS	4
+
+#define HCSR04_IOC_SET_FORMAT	_IO(HCSR04_IOC_MAGIC, 5)
+
+struct hcsr04_record {
+	__u64 timestamp_ns;		/* ktime_get() time of the echo end */
+	__u32 distance_mm;
+	__u16 status;			/* 0, ETIMEDOUT (no echo), ERANGE (out of range) or EIO (bus or pin error) */
+	__u16 reserved;
+	__u32 latency_ns;		/* echo end to copy to user space */
+	__u32 reserved2;
+};
+
+/*
+ *	Priority request for a fresh sample within deadline_us. The ping goes ahead of every normal reader and only waits for the ping
+ *	in flight and the guard time between pings. latency_ns is the time from the request to the echo end, met tells whether the
+ *	sample was valid and in time. The sample is returned either way. While a sampling engine runs (sysfs engine) the request gets
+ *	its own ping between two engine ticks, after the engine ping in flight and the guard, without moving the engine's schedule.
+ *	With an hrtimer engine whose next tick leaves no room for the ping, its timeout and the guard, the next engine sample answers.
+ */
+
+struct hcsr04_fresh {
+	__u32 deadline_us;
+	__u32 latency_ns;
+	__u32 met;
+	__u32 reserved;
+	struct hcsr04_record record;
+};
+
+#define HCSR04_IOC_FRESH	_IOWR(HCSR04_IOC_MAGIC, 6, struct hcsr04_fresh)
+
+/*
+ *	Split-phase pings (HCSR04_FORMAT_ASYNC). HCSR04_IOC_SUBMIT queues count pings and returns at once with the id of the first one,
+ *	the others follow consecutively. write() of a __u32 count does the same; ids are per open file and start at 1, so they are known
+ *	without the ioctl. The pings run in the background in submit order, each result is read() as a struct hcsr04_async_record.
+ *	read() blocks until at least one result is there (-EAGAIN with O_NONBLOCK), poll() reports POLLIN when results are ready.
+ *	At most HCSR04_ASYNC_MAX pings can be submitted or uncollected at a time, beyond that submitting fails with EBUSY.
+ *	Besides the statuses of struct hcsr04_record, an async record can have status EINTR: the ping was aborted before it completed.
+ */
+
+#define HCSR04_ASYNC_MAX 64
+
+struct hcsr04_submit {
+	__u32 count;
+	__u32 first_id;
+};
+
+struct hcsr04_async_record {
+	__u32 id;
+	__u32 reserved;
+	struct hcsr04_record record;
+};
+
+#define HCSR04_IOC_SUBMIT	_IOWR(HCSR04_IOC_MAGIC, 7, struct hcsr04_submit)
+
+/*
+ *	Deadband of an HCSR04_FORMAT_STREAM reader ("report on change"). An engine sample is only queued when its distance differs
+ *	by more than deadband_mm from the last sample delivered, its status changed, or heartbeat_ms passed since that delivery
+ *	(0 means no heartbeat). deadband_mm 0, the default, delivers every sample. The first sample after setting it is always delivered.
+ */
+
+struct hcsr04_deadband {
+	__u32 deadband_mm;
+	__u32 heartbeat_ms;
+};
+
+#define HCSR04_IOC_SET_DEADBAND	_IOW(HCSR04_IOC_MAGIC, 8, struct hcsr04_deadband)
+
+/*
+ *	Closest obstacle per sector. Sectors are servo angle ranges (sysfs sectors, e.g. "0-59 60-119 120-180"); without a servo
+ *	every sample is at 0 degrees. The sampling engine puts each sample in the sectors containing the servo angle at that time and
+ *	after sector_cycle samples publishes the minimum of every sector with its angle and time. A sector without a valid sample in
+ *	the cycle has status ENODATA. HCSR04_IOC_GET_SECTORS returns the last published cycle, cycle counts them from 1.
+ */
+
+#define HCSR04_SECTORS_MAX 8
+
+struct hcsr04_sector {
+	__u64 timestamp_ns;		/* ktime_get() time of the echo end */
+	__u32 min_mm;
+	__u16 angle_deg;
+	__u16 status;			/* 0 or ENODATA */
+};
+
+struct hcsr04_sectors {
+	__u32 cycle;
+	__u32 count;
+	struct hcsr04_sector sectors[HCSR04_SECTORS_MAX];
+};
+
+#define HCSR04_IOC_GET_SECTORS	_IOR(HCSR04_IOC_MAGIC, 9, struct hcsr04_sectors)
+
+/*
+ *	Distance histogram, read from the binary sysfs attribute /sys/class/hcsr04/hcsr04_1/histogram. Bin i counts distances in
+ *	[i * bin_mm, (i + 1) * bin_mm), the last bin also everything above. errors counts pings without a distance.
+ *	The accumulator is enabled by writing a bin width to hist_bin_mm. With hist_window_ms set, reads return the last complete
+ *	window, otherwise everything since the previous read. Every read resets what it returned.
+ */
+
+#define HCSR04_HIST_BINS 64
+
+struct hcsr04_histogram {
+	__u64 window_start_ns;
+	__u64 window_ns;
+	__u32 bin_mm;
+	__u32 nbins;
+	__u32 total;
+	__u32 errors;
+	__u32 bins[HCSR04_HIST_BINS];
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hcsr04_kernels.h"
+
+/*
+ *	Runs every kernel implementation available on this CPU over the same synthetic batch, checks
+ *	the results against the scalar reference and prints the time per sample.
+ *
+ *	usage: bench_kernels [samples] [rounds]
+ */
+
+static double now_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, const char *kernel, double seconds, size_t samples, double reference) {
+	double ns = seconds * 1e9 / samples;
+
+	if (reference > 0)
+		printf("%-8s %-12s %8.3f ns/sample  %5.2fx\n", name, kernel, ns, reference / seconds);
+	else
+		printf("%-8s %-12s %8.3f ns/sample\n", name, kernel, ns);
+}
+
+int main(int argc, char **argv) {
+	size_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+	int rounds = argc > 2 ? atoi(argv[2]) : 50;
+	const struct hcsr04_kernels *const *k;
+	uint32_t *echo, *mm, *mm_ref, *med, *med_ref;
+	int32_t *delta, *delta_ref;
+	double ref[3] = { 0, 0, 0 };
+	int failed = 0;
+	size_t i;
+
+	echo = malloc(count * sizeof(*echo));
+	mm = malloc(count * sizeof(*mm));
+	mm_ref = malloc(count * sizeof(*mm_ref));
+	med = malloc(count * sizeof(*med));
+	med_ref = malloc(count * sizeof(*med_ref));
+	delta = malloc(count * sizeof(*delta));
+	delta_ref = malloc(count * sizeof(*delta_ref));
+
+	if (!echo || !mm || !mm_ref || !med || !med_ref || !delta || !delta_ref) {
+		perror("malloc");
+		return 1;
+	}
+
+	/* A slowly moving target with some noise and the odd outlier, 2 cm .. 4 m */
+	srand(1);
+
+	for (i = 0; i < count; i++) {
+		uint32_t base = 116000 + (i % 20000) * 1150;
+
+		echo[i] = base + rand() % 3000;
+		if (rand() % 100 == 0)
+			echo[i] = rand() % 23200000;
+	}
+
+	hcsr04_kernels_scalar.echo_to_mm(echo, mm_ref, count, 20.0f);
+	hcsr04_kernels_scalar.median5(mm_ref, med_ref, count);
+	hcsr04_kernels_scalar.delta(med_ref, delta_ref, count, 0);
+
+	printf("%zu samples, %d rounds\n", count, rounds);
+
+	for (k = hcsr04_kernels_available(); *k; k++) {
+		double t;
+		int r;
+
+		t = now_s();
+		for (r = 0; r < rounds; r++)
+			(*k)->echo_to_mm(echo, mm, count, 20.0f);
+		t = now_s() - t;
+		report("to_mm", (*k)->name, t / rounds, count, ref[0]);
+		if (*k == &hcsr04_kernels_scalar)
+			ref[0] = t / rounds;
+
+		/* Float rounding may differ by one unit if the compiler fused the scalar multiply-add */
+		for (i = 0; i < count; i++) {
+			if (mm[i] + 1 < mm_ref[i] || mm[i] > mm_ref[i] + 1) {
+				printf("  mismatch at %zu: %u != %u\n", i, mm[i], mm_ref[i]);
+				failed = 1;
+				break;
+			}
+		}
+
+		t = now_s();
+		for (r = 0; r < rounds; r++)
+			(*k)->median5(mm_ref, med, count);
+		t = now_s() - t;
+		report("median5", (*k)->name, t / rounds, count, ref[1]);
+		if (*k == &hcsr04_kernels_scalar)
+			ref[1] = t / rounds;
+
+		if (memcmp(med, med_ref, count * sizeof(*med))) {
+			printf("  median5 mismatch\n");
+			failed = 1;
+		}
+
+		t = now_s();
+		for (r = 0; r < rounds; r++)
+			(*k)->delta(med_ref, delta, count, 0);
+		t = now_s() - t;
+		report("delta", (*k)->name, t / rounds, count, ref[2]);
+		if (*k == &hcsr04_kernels_scalar)
+			ref[2] = t / rounds;
+
+		if (memcmp(delta, delta_ref, count * sizeof(*delta))) {
+			printf("  delta mismatch\n");
+			failed = 1;
+		}
+	}
+
+	free(echo);
+	free(mm);
+	free(mm_ref);
+	free(med);
+	free(med_ref);
+	free(delta);
+	free(delta_ref);
+
+	return failed;
+}
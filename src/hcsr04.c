@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hcsr04.h"
+
+struct hcsr04_handle {
+	int fd;
+	enum hcsr04_mode mode;
+	struct hcsr04_sample samples[HCSR04_BATCH_MAX];
+	struct hcsr04_record records[HCSR04_BATCH_MAX];
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *	The driver returns "<n>cm\n" followed by a NUL. Anything else is treated as a short read.
+ */
+
+static int parse_text(const char *buf, ssize_t len, uint32_t *distance_mm) {
+	uint32_t cm = 0;
+	ssize_t i;
+
+	for (i = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++)
+		cm = cm * 10 + (buf[i] - '0');
+
+	if (i == 0 || i + 1 >= len || buf[i] != 'c' || buf[i + 1] != 'm')
+		return -1;
+
+	*distance_mm = cm * 10;
+
+	return 0;
+}
+
+static int read_text(struct hcsr04_handle *dev, struct hcsr04_sample *sample) {
+	char buf[16];
+	ssize_t len;
+
+	/*
+	 *	pread() at offset 0 instead of read(): get_distance() returns end-of-file whenever the file
+	 *	offset is non-zero, so plain read() only produces a sample on every other call.
+	 */
+
+	len = pread(dev->fd, buf, sizeof(buf), 0);
+	sample->timestamp_ns = now_ns();
+	sample->distance_mm = 0;
+	sample->flags = 0;
+
+	if (len < 0) {
+		if (errno == ETIMEDOUT) {
+			sample->flags = HCSR04_SAMPLE_TIMEOUT;
+			return 0;
+		}
+		if (errno == ERANGE) {
+			sample->flags = HCSR04_SAMPLE_RANGE;
+			return 0;
+		}
+		if (errno == EIO) {
+			sample->flags = HCSR04_SAMPLE_ERROR;
+			return 0;
+		}
+		return -1;
+	}
+
+	if (parse_text(buf, len, &sample->distance_mm)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Binary mode: a single read() returns as many records as the buffer holds, each one a ping in the driver.
+ */
+
+static void record_to_sample(const struct hcsr04_record *record, struct hcsr04_sample *sample) {
+	sample->timestamp_ns = record->timestamp_ns;
+	sample->distance_mm = record->distance_mm;
+	sample->flags = 0;
+
+	if (record->status == ETIMEDOUT)
+		sample->flags = HCSR04_SAMPLE_TIMEOUT;
+	else if (record->status == ERANGE)
+		sample->flags = HCSR04_SAMPLE_RANGE;
+	else if (record->status)
+		sample->flags = HCSR04_SAMPLE_ERROR;
+}
+
+static ssize_t read_binary(struct hcsr04_handle *dev, struct hcsr04_sample *samples, size_t count) {
+	ssize_t len;
+	size_t i, n;
+
+	len = read(dev->fd, dev->records, count * sizeof(dev->records[0]));
+
+	if (len < 0)
+		return -1;
+
+	n = len / sizeof(dev->records[0]);
+
+	for (i = 0; i < n; i++)
+		record_to_sample(&dev->records[i], &samples[i]);
+
+	return n;
+}
+
+struct hcsr04_handle *hcsr04_open(const char *path) {
+	struct hcsr04_handle *dev;
+
+	dev = calloc(1, sizeof(*dev));
+
+	if (!dev)
+		return NULL;
+
+	dev->fd = open(path ? path : HCSR04_DEFAULT_DEVICE, O_RDONLY | O_CLOEXEC);
+
+	if (dev->fd < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	/* Drivers without HCSR04_IOC_SET_FORMAT only speak text */
+	if (ioctl(dev->fd, HCSR04_IOC_SET_FORMAT, HCSR04_FORMAT_BINARY) == 0)
+		dev->mode = HCSR04_MODE_BINARY;
+	else
+		dev->mode = HCSR04_MODE_TEXT;
+
+	return dev;
+}
+
+void hcsr04_close(struct hcsr04_handle *dev) {
+	if (!dev)
+		return;
+
+	close(dev->fd);
+	free(dev);
+}
+
+int hcsr04_fd(const struct hcsr04_handle *dev) {
+	return dev->fd;
+}
+
+enum hcsr04_mode hcsr04_mode(const struct hcsr04_handle *dev) {
+	return dev->mode;
+}
+
+const char *hcsr04_mode_name(enum hcsr04_mode mode) {
+	switch (mode) {
+	case HCSR04_MODE_TEXT:
+		return "text";
+	case HCSR04_MODE_BINARY:
+		return "binary";
+	}
+
+	return "unknown";
+}
+
+int hcsr04_read(struct hcsr04_handle *dev, struct hcsr04_sample *sample) {
+	if (dev->mode == HCSR04_MODE_BINARY)
+		return read_binary(dev, sample, 1) == 1 ? 0 : -1;
+
+	return read_text(dev, sample);
+}
+
+const struct hcsr04_sample *hcsr04_batch(struct hcsr04_handle *dev, size_t count, size_t *got) {
+	size_t i;
+
+	if (count > HCSR04_BATCH_MAX)
+		count = HCSR04_BATCH_MAX;
+
+	if (dev->mode == HCSR04_MODE_BINARY) {
+		ssize_t n = count ? read_binary(dev, dev->samples, count) : 0;
+
+		if (n < 0)
+			return NULL;
+
+		*got = n;
+
+		return dev->samples;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (hcsr04_read(dev, &dev->samples[i]))
+			break;
+	}
+
+	*got = i;
+
+	if (i == 0 && count > 0)
+		return NULL;
+
+	return dev->samples;
+}
+
+int hcsr04_scan(struct hcsr04_handle *dev, unsigned int start_deg, unsigned int end_deg, unsigned int step_deg,
+		unsigned int settle_ms, struct hcsr04_scan_record *records, size_t capacity) {
+	struct hcsr04_scan scan = {
+		.start_deg = start_deg,
+		.end_deg = end_deg,
+		.step_deg = step_deg,
+		.settle_ms = settle_ms,
+		.count = capacity,
+		.records = (uintptr_t)records,
+	};
+
+	if (ioctl(dev->fd, HCSR04_IOC_SCAN, &scan))
+		return -1;
+
+	return scan.count;
+}
+
+int hcsr04_fresh(struct hcsr04_handle *dev, unsigned int deadline_us, struct hcsr04_fresh *fresh) {
+	memset(fresh, 0, sizeof(*fresh));
+	fresh->deadline_us = deadline_us;
+
+	return ioctl(dev->fd, HCSR04_IOC_FRESH, fresh);
+}
+
+int hcsr04_set_lut(struct hcsr04_handle *dev, const struct hcsr04_lut *lut) {
+	return ioctl(dev->fd, HCSR04_IOC_SET_LUT, lut);
+}
+
+int hcsr04_get_lut(struct hcsr04_handle *dev, struct hcsr04_lut *lut) {
+	return ioctl(dev->fd, HCSR04_IOC_GET_LUT, lut);
+}
@@ -0,0 +1,86 @@
+#ifndef HCSR04_H
+#define HCSR04_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../hcsr04_ioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HCSR04_DEFAULT_DEVICE "/dev/hcsr04_1"
+
+/* Size of the sample buffer owned by each handle, and so the largest batch hcsr04_batch() returns */
+#define HCSR04_BATCH_MAX 64
+
+/*
+ *	Access modes the library can use to talk to the driver, ordered from slowest to fastest.
+ *	hcsr04_open() always picks the fastest one the loaded driver supports.
+ */
+
+enum hcsr04_mode {
+	HCSR04_MODE_TEXT = 0,		/* one ping per read(), "123cm\n" */
+	HCSR04_MODE_BINARY,		/* one read() per batch, struct hcsr04_record */
+};
+
+/* Sample flags */
+#define HCSR04_SAMPLE_TIMEOUT	(1u << 0)	/* no echo within the driver timeout */
+#define HCSR04_SAMPLE_RANGE	(1u << 1)	/* echo out of the sensor range */
+#define HCSR04_SAMPLE_ERROR	(1u << 2)	/* the driver could not ping (bus or pin error) or the ping was aborted */
+
+struct hcsr04_sample {
+	uint64_t timestamp_ns;		/* CLOCK_MONOTONIC time the sample was taken (echo end in binary mode) */
+	uint32_t distance_mm;		/* 0 when flags is non-zero */
+	uint32_t flags;
+};
+
+struct hcsr04_handle;
+
+struct hcsr04_handle *hcsr04_open(const char *path);
+void hcsr04_close(struct hcsr04_handle *dev);
+
+int hcsr04_fd(const struct hcsr04_handle *dev);
+enum hcsr04_mode hcsr04_mode(const struct hcsr04_handle *dev);
+const char *hcsr04_mode_name(enum hcsr04_mode mode);
+
+/*
+ *	hcsr04_read() takes one sample. Failed pings (timeout, out of range) are not errors, they are
+ *	returned as flagged samples so the caller keeps its cadence. Returns 0 or -1 with errno set.
+ */
+
+int hcsr04_read(struct hcsr04_handle *dev, struct hcsr04_sample *sample);
+
+/*
+ *	hcsr04_batch() takes up to count samples (at most HCSR04_BATCH_MAX) into the buffer owned by the
+ *	handle and returns a view of it. The view stays valid until the next call on the same handle,
+ *	nothing is allocated or copied per batch. Returns NULL with errno set on error.
+ */
+
+const struct hcsr04_sample *hcsr04_batch(struct hcsr04_handle *dev, size_t count, size_t *got);
+
+/*
+ *	hcsr04_scan() runs one servo sweep in the driver (the module needs servo_pwm) and stores one record per position.
+ *	Returns the number of records or -1 with errno set.
+ */
+
+int hcsr04_scan(struct hcsr04_handle *dev, unsigned int start_deg, unsigned int end_deg, unsigned int step_deg,
+		unsigned int settle_ms, struct hcsr04_scan_record *records, size_t capacity);
+
+/*
+ *	hcsr04_fresh() asks the driver for a sample within deadline_us, ahead of all other readers. fresh->met and fresh->latency_ns
+ *	report whether and how fast that worked. Returns 0 or -1 with errno set.
+ */
+
+int hcsr04_fresh(struct hcsr04_handle *dev, unsigned int deadline_us, struct hcsr04_fresh *fresh);
+
+/* Calibration table applied by the driver to every sample, see hcsr04_ioctl.h. Return 0 or -1 with errno set */
+int hcsr04_set_lut(struct hcsr04_handle *dev, const struct hcsr04_lut *lut);
+int hcsr04_get_lut(struct hcsr04_handle *dev, struct hcsr04_lut *lut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef HCSR04_HPP
+#define HCSR04_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#include "hcsr04.h"
+
+/*
+ *	Header-only C++20 layer over libhcsr04. Errors are reported as std::system_error, failed pings
+ *	come back as flagged samples exactly like in the C API.
+ */
+
+namespace hcsr04 {
+
+using Sample = hcsr04_sample;
+
+enum class Mode {
+	Text = HCSR04_MODE_TEXT,
+	Binary = HCSR04_MODE_BINARY,
+};
+
+class Sensor {
+public:
+	explicit Sensor(const char *path = HCSR04_DEFAULT_DEVICE)
+		: dev_(hcsr04_open(path)) {
+		if (!dev_)
+			throw std::system_error(errno, std::generic_category(), "hcsr04_open");
+	}
+
+	~Sensor() {
+		hcsr04_close(dev_);
+	}
+
+	Sensor(const Sensor &) = delete;
+	Sensor &operator=(const Sensor &) = delete;
+
+	Sensor(Sensor &&other) noexcept
+		: dev_(std::exchange(other.dev_, nullptr)) {
+	}
+
+	Sensor &operator=(Sensor &&other) noexcept {
+		if (this != &other) {
+			hcsr04_close(dev_);
+			dev_ = std::exchange(other.dev_, nullptr);
+		}
+		return *this;
+	}
+
+	int fd() const {
+		return hcsr04_fd(dev_);
+	}
+
+	Mode mode() const {
+		return static_cast<Mode>(hcsr04_mode(dev_));
+	}
+
+	const char *mode_name() const {
+		return hcsr04_mode_name(hcsr04_mode(dev_));
+	}
+
+	Sample next() {
+		Sample sample;
+
+		if (hcsr04_read(dev_, &sample))
+			throw std::system_error(errno, std::generic_category(), "hcsr04_read");
+
+		return sample;
+	}
+
+	/* The span views the handle's own buffer and is invalidated by the next call on this sensor */
+	std::span<const Sample> batch(std::size_t count) {
+		std::size_t got = 0;
+		const Sample *samples = hcsr04_batch(dev_, count, &got);
+
+		if (!samples)
+			throw std::system_error(errno, std::generic_category(), "hcsr04_batch");
+
+		return {samples, got};
+	}
+
+	/* One servo sweep, the span views the caller's buffer */
+	std::span<const hcsr04_scan_record> scan(unsigned int start_deg, unsigned int end_deg, unsigned int step_deg,
+						 unsigned int settle_ms, std::span<hcsr04_scan_record> records) {
+		int n = hcsr04_scan(dev_, start_deg, end_deg, step_deg, settle_ms, records.data(), records.size());
+
+		if (n < 0)
+			throw std::system_error(errno, std::generic_category(), "hcsr04_scan");
+
+		return {records.data(), static_cast<std::size_t>(n)};
+	}
+
+	hcsr04_handle *handle() const {
+		return dev_;
+	}
+
+private:
+	hcsr04_handle *dev_;
+};
+
+}
+
+#endif
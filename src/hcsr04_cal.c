@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "hcsr04_cal.h"
+
+/* The two points of a linear table, anywhere in the range works since the driver extends the segment */
+#define LINEAR_LOW_MM	100
+#define LINEAR_HIGH_MM	4000
+
+int hcsr04_cal_collect(struct hcsr04_handle *dev, unsigned int samples, unsigned int interval_ms,
+		       struct hcsr04_cal_collect *stats) {
+	memset(stats, 0, sizeof(*stats));
+	stats->samples = samples;
+	stats->interval_ms = interval_ms;
+
+	return ioctl(hcsr04_fd(dev), HCSR04_IOC_CAL_COLLECT, stats);
+}
+
+int hcsr04_cal_fit(const struct hcsr04_cal_point *points, size_t count, double *gain, double *offset) {
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, d;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		double x = points[i].raw_mm, y = points[i].ref_mm;
+
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	d = count * sxx - sx * sx;
+
+	if (count < 2 || d == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*gain = (count * sxy - sx * sy) / d;
+	*offset = (sy - *gain * sx) / count;
+
+	return 0;
+}
+
+static uint32_t to_mm(double v) {
+	return v < 0 ? 0 : (uint32_t)(v + 0.5);
+}
+
+int hcsr04_cal_linear_lut(double gain, double offset, struct hcsr04_lut *lut) {
+	if (gain <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(lut, 0, sizeof(*lut));
+	lut->count = 2;
+	lut->points[0].raw_mm = LINEAR_LOW_MM;
+	lut->points[0].cal_mm = to_mm(gain * LINEAR_LOW_MM + offset);
+	lut->points[1].raw_mm = LINEAR_HIGH_MM;
+	lut->points[1].cal_mm = to_mm(gain * LINEAR_HIGH_MM + offset);
+
+	return 0;
+}
+
+static int cmp_raw(const void *a, const void *b) {
+	const struct hcsr04_cal_point *x = a, *y = b;
+
+	return x->raw_mm < y->raw_mm ? -1 : x->raw_mm > y->raw_mm;
+}
+
+int hcsr04_cal_piecewise_lut(const struct hcsr04_cal_point *points, size_t count, struct hcsr04_lut *lut) {
+	struct hcsr04_cal_point sorted[HCSR04_LUT_MAX];
+	size_t i;
+
+	if (count < 2 || count > HCSR04_LUT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(sorted, points, count * sizeof(*points));
+	qsort(sorted, count, sizeof(*sorted), cmp_raw);
+
+	memset(lut, 0, sizeof(*lut));
+	lut->count = count;
+
+	for (i = 0; i < count; i++) {
+		if (i && sorted[i].raw_mm == sorted[i - 1].raw_mm) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		lut->points[i].raw_mm = sorted[i].raw_mm;
+		lut->points[i].cal_mm = sorted[i].ref_mm;
+	}
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef HCSR04_CAL_H
+#define HCSR04_CAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hcsr04.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	Calibration against targets at known distances. For every reference distance the driver collects raw
+ *	(uncalibrated) samples, then either a least squares gain/offset or a piecewise table through the measured
+ *	points is turned into a calibration table and loaded into the driver with hcsr04_set_lut().
+ */
+
+struct hcsr04_cal_point {
+	uint32_t ref_mm;		/* where the target really is */
+	uint32_t raw_mm;		/* what the sensor measured, usually the median of a collection */
+};
+
+/* Runs HCSR04_IOC_CAL_COLLECT. Returns 0 or -1 with errno set (ETIMEDOUT: no ping produced a distance) */
+int hcsr04_cal_collect(struct hcsr04_handle *dev, unsigned int samples, unsigned int interval_ms,
+		       struct hcsr04_cal_collect *stats);
+
+/* Least squares fit of ref_mm = gain * raw_mm + offset. Needs two points with different raw_mm */
+int hcsr04_cal_fit(const struct hcsr04_cal_point *points, size_t count, double *gain, double *offset);
+
+/* Two point table implementing a gain/offset correction over the whole range */
+int hcsr04_cal_linear_lut(double gain, double offset, struct hcsr04_lut *lut);
+
+/* Table through the measured points themselves, at most HCSR04_LUT_MAX points with distinct raw_mm */
+int hcsr04_cal_piecewise_lut(const struct hcsr04_cal_point *points, size_t count, struct hcsr04_lut *lut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef HCSR04_CORO_HPP
+#define HCSR04_CORO_HPP
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "hcsr04.hpp"
+
+/*
+ *	C++20 awaitables over libhcsr04. Any number of coroutines can wait on one AsyncSensor: every
+ *	sample is handed to all of them, so a ping is shared instead of being repeated per consumer.
+ *	Waiters are linked through the awaiter objects themselves, which live in the suspended coroutine
+ *	frames, so awaiting never allocates.
+ *
+ *	The descriptor runs in HCSR04_FORMAT_ASYNC with O_NONBLOCK: while somebody waits, one ping is
+ *	submitted to the driver, and fd() becomes readable when its result is there. dispatch() only
+ *	collects results that are ready, it never blocks the executor for a ping. The sensor does not
+ *	own an event loop. The executor watches fd() and calls dispatch() when it is readable and
+ *	pending() is true. run() below is a minimal poll() based loop for programs that do not have one.
+ */
+
+namespace hcsr04 {
+
+class AsyncSensor {
+	struct Waiter {
+		Waiter *next = nullptr;
+		std::coroutine_handle<> handle;
+		std::span<Sample> out;
+		std::size_t filled = 0;
+		int error = 0;
+	};
+
+	template <typename Result>
+	struct Awaiter : Waiter {
+		AsyncSensor *sensor;
+		Sample sample;
+
+		/* An empty batch is complete right away */
+		bool await_ready() const noexcept {
+			if constexpr (std::is_same_v<Result, Sample>)
+				return false;
+			else
+				return this->out.empty();
+		}
+
+		/* Does not suspend if no ping could be submitted, await_resume() then throws */
+		bool await_suspend(std::coroutine_handle<> handle) noexcept {
+			/* next() stores into the awaiter itself, which only has a fixed address once suspended */
+			if constexpr (std::is_same_v<Result, Sample>)
+				this->out = {&sample, 1};
+
+			this->handle = handle;
+
+			return sensor->enqueue(this);
+		}
+
+		Result await_resume() const {
+			if (this->error)
+				throw std::system_error(this->error, std::generic_category(), "hcsr04_read");
+
+			if constexpr (std::is_same_v<Result, Sample>)
+				return sample;
+			else
+				return {this->out.data(), this->filled};
+		}
+	};
+
+public:
+	explicit AsyncSensor(const char *path = HCSR04_DEFAULT_DEVICE)
+		: sensor_(path) {
+		int flags;
+
+		if (ioctl(fd(), HCSR04_IOC_SET_FORMAT, HCSR04_FORMAT_ASYNC))
+			throw std::system_error(errno, std::generic_category(), "HCSR04_IOC_SET_FORMAT");
+
+		flags = fcntl(fd(), F_GETFL);
+
+		if (flags < 0 || fcntl(fd(), F_SETFL, flags | O_NONBLOCK))
+			throw std::system_error(errno, std::generic_category(), "fcntl");
+	}
+
+	AsyncSensor(const AsyncSensor &) = delete;
+	AsyncSensor &operator=(const AsyncSensor &) = delete;
+
+	int fd() const {
+		return sensor_.fd();
+	}
+
+	bool pending() const {
+		return waiters_ != nullptr;
+	}
+
+	/* co_await sensor.next() resumes with the next sample the driver completes */
+	auto next() {
+		Awaiter<Sample> awaiter;
+
+		awaiter.sensor = this;
+
+		return awaiter;
+	}
+
+	/* co_await sensor.batch(out) resumes once out is full, with a view of it */
+	auto batch(std::span<Sample> out) {
+		Awaiter<std::span<const Sample>> awaiter;
+
+		awaiter.sensor = this;
+		awaiter.out = out;
+
+		return awaiter;
+	}
+
+	/* Collects the results that are ready and delivers each of them to every waiter */
+	void dispatch() {
+		struct hcsr04_async_record result;
+		ssize_t len;
+
+		while (waiters_ && in_flight_) {
+			len = read(fd(), &result, sizeof(result));
+
+			if (len < 0 && errno == EINTR)
+				continue;
+
+			if (len < 0 && errno == EAGAIN)
+				return;
+
+			/* The ping is given up on, so the next waiter submits a new one instead of waiting for it */
+			if (len < 0) {
+				in_flight_ = false;
+				deliver(nullptr, errno);
+				return;
+			}
+
+			in_flight_ = false;
+			deliver(&result.record, 0);
+		}
+	}
+
+private:
+	/*
+	 *	Waiters that are complete are unlinked before any of them is resumed, so a resumed coroutine
+	 *	can safely co_await again. The ping for the remaining waiters is submitted before resuming.
+	 */
+	void deliver(const hcsr04_record *record, int error) {
+		Waiter *list = waiters_, *done = nullptr, **tail = &waiters_;
+		Sample sample{};
+
+		waiters_ = nullptr;
+
+		if (record) {
+			sample.timestamp_ns = record->timestamp_ns;
+			sample.distance_mm = record->distance_mm;
+
+			if (record->status == ETIMEDOUT)
+				sample.flags = HCSR04_SAMPLE_TIMEOUT;
+			else if (record->status == ERANGE)
+				sample.flags = HCSR04_SAMPLE_RANGE;
+			else if (record->status)
+				sample.flags = HCSR04_SAMPLE_ERROR;
+		}
+
+		while (list) {
+			Waiter *w = list;
+
+			list = list->next;
+
+			if (error) {
+				w->error = error;
+			} else {
+				w->out[w->filled++] = sample;
+			}
+
+			if (error || w->filled == w->out.size()) {
+				w->next = done;
+				done = w;
+			} else {
+				w->next = nullptr;
+				*tail = w;
+				tail = &w->next;
+			}
+		}
+
+		if (waiters_ && !in_flight_ && submit()) {
+			error = errno;
+
+			for (Waiter *w = waiters_; w; w = w->next)
+				w->error = error;
+
+			*tail = done;
+			done = waiters_;
+			waiters_ = nullptr;
+		}
+
+		while (done) {
+			Waiter *w = done;
+
+			done = done->next;
+			w->handle.resume();
+		}
+	}
+
+	/* Queues one ping in the driver, its result makes fd() readable */
+	int submit() {
+		struct hcsr04_submit request = { 1, 0 };
+
+		if (ioctl(fd(), HCSR04_IOC_SUBMIT, &request))
+			return -1;
+
+		in_flight_ = true;
+
+		return 0;
+	}
+
+	/* Returns false, with the error set, when the waiter cannot be served and must not suspend */
+	bool enqueue(Waiter *w) {
+		if (!in_flight_ && submit()) {
+			w->error = errno;
+			return false;
+		}
+
+		w->next = waiters_;
+		waiters_ = w;
+
+		return true;
+	}
+
+	Sensor sensor_;
+	Waiter *waiters_ = nullptr;
+	bool in_flight_ = false;
+};
+
+/*
+ *	Drives the given sensors until nobody is waiting on them. All descriptors are polled together,
+ *	and only the sensors whose ping completed are dispatched.
+ */
+
+inline void run(std::span<AsyncSensor *const> sensors) {
+	std::vector<struct pollfd> pfds(sensors.size());
+	bool busy = true;
+
+	while (busy) {
+		busy = false;
+
+		for (std::size_t i = 0; i < sensors.size(); i++) {
+			pfds[i] = { sensors[i]->pending() ? sensors[i]->fd() : -1, POLLIN, 0 };
+			busy |= sensors[i]->pending();
+		}
+
+		if (!busy)
+			break;
+
+		if (poll(pfds.data(), pfds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw std::system_error(errno, std::generic_category(), "poll");
+		}
+
+		for (std::size_t i = 0; i < sensors.size(); i++) {
+			if (pfds[i].revents)
+				sensors[i]->dispatch();
+		}
+	}
+}
+}
+
+#endif
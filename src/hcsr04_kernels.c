@@ -0,0 +1,371 @@
+#include "hcsr04_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+/*
+ *	Speed of sound in air is 331.3 + 0.606 * T m/s. One nanosecond of echo at c m/s is c * 1e-6 mm
+ *	of round trip, so half of that is the distance to the target.
+ */
+
+static float mm_per_ns(float temp_c) {
+	return (331.3f + 0.606f * temp_c) * 0.5e-6f;
+}
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b) {
+	return a < b ? a : b;
+}
+
+static inline uint32_t max_u32(uint32_t a, uint32_t b) {
+	return a > b ? a : b;
+}
+
+/*
+ *	Median of five with min/max only, so every implementation uses the same network:
+ *	after sorting (a, b), (c, d) and then (a, c), (b, d), a is the smallest and d the largest of the
+ *	first four. Neither can be the median of all five, which leaves the median of b, c and e.
+ */
+
+static inline uint32_t median5_u32(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e) {
+	uint32_t t;
+
+	t = min_u32(a, b); b = max_u32(a, b); a = t;
+	t = min_u32(c, d); d = max_u32(c, d); c = t;
+	c = max_u32(a, c);
+	b = min_u32(b, d);
+
+	t = min_u32(b, c);
+	c = max_u32(b, c);
+
+	return max_u32(t, min_u32(c, e));
+}
+
+static inline uint32_t at_clamped(const uint32_t *in, size_t count, ptrdiff_t i) {
+	if (i < 0)
+		return in[0];
+	if ((size_t)i >= count)
+		return in[count - 1];
+	return in[i];
+}
+
+static void median5_edges(const uint32_t *in, uint32_t *out, size_t count, size_t from, size_t to) {
+	size_t i;
+
+	for (i = from; i < to; i++) {
+		out[i] = median5_u32(at_clamped(in, count, i - 2), at_clamped(in, count, i - 1), in[i],
+				     at_clamped(in, count, i + 1), at_clamped(in, count, i + 2));
+	}
+}
+
+/* ~ Scalar reference ~ */
+
+static void echo_to_mm_scalar(const uint32_t *echo_ns, uint32_t *mm, size_t count, float temp_c) {
+	float k = mm_per_ns(temp_c);
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		mm[i] = (uint32_t)((float)(int32_t)echo_ns[i] * k + 0.5f);
+}
+
+static void median5_scalar(const uint32_t *in, uint32_t *out, size_t count) {
+	median5_edges(in, out, count, 0, count);
+}
+
+static void delta_scalar(const uint32_t *in, int32_t *out, size_t count, uint32_t prev) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		out[i] = (int32_t)(in[i] - prev);
+		prev = in[i];
+	}
+}
+
+const struct hcsr04_kernels hcsr04_kernels_scalar = {
+	.name = "scalar",
+	.echo_to_mm = echo_to_mm_scalar,
+	.median5 = median5_scalar,
+	.delta = delta_scalar,
+};
+
+/*
+ *	The vector versions below process whole vectors in the middle of the array and leave the
+ *	remainder (and the two clamped values at each end for median5) to the scalar code.
+ */
+
+#ifdef HAVE_X86
+
+/* ~ SSE4.1 ~ */
+
+__attribute__((target("sse4.1")))
+static void echo_to_mm_sse41(const uint32_t *echo_ns, uint32_t *mm, size_t count, float temp_c) {
+	__m128 k = _mm_set1_ps(mm_per_ns(temp_c)), half = _mm_set1_ps(0.5f);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(echo_ns + i)));
+
+		v = _mm_add_ps(_mm_mul_ps(v, k), half);
+		_mm_storeu_si128((__m128i *)(mm + i), _mm_cvttps_epi32(v));
+	}
+
+	echo_to_mm_scalar(echo_ns + i, mm + i, count - i, temp_c);
+}
+
+__attribute__((target("sse4.1")))
+static void median5_sse41(const uint32_t *in, uint32_t *out, size_t count) {
+	size_t i = 2;
+
+	if (count < 8) {
+		median5_scalar(in, out, count);
+		return;
+	}
+
+	median5_edges(in, out, count, 0, 2);
+
+	for (; i + 4 + 2 <= count; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(in + i - 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + i - 1));
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(in + i + 1));
+		__m128i e = _mm_loadu_si128((const __m128i *)(in + i + 2));
+		__m128i t;
+
+		t = _mm_min_epu32(a, b); b = _mm_max_epu32(a, b); a = t;
+		t = _mm_min_epu32(c, d); d = _mm_max_epu32(c, d); c = t;
+		c = _mm_max_epu32(a, c);
+		b = _mm_min_epu32(b, d);
+		t = _mm_min_epu32(b, c);
+		c = _mm_max_epu32(b, c);
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_max_epu32(t, _mm_min_epu32(c, e)));
+	}
+
+	median5_edges(in, out, count, i, count);
+}
+
+__attribute__((target("sse4.1")))
+static void delta_sse41(const uint32_t *in, int32_t *out, size_t count, uint32_t prev) {
+	size_t i = 1;
+
+	if (count == 0)
+		return;
+
+	out[0] = (int32_t)(in[0] - prev);
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i last = _mm_loadu_si128((const __m128i *)(in + i - 1));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi32(cur, last));
+	}
+
+	delta_scalar(in + i, out + i, count - i, in[i - 1]);
+}
+
+static const struct hcsr04_kernels kernels_sse41 = {
+	.name = "sse4.1",
+	.echo_to_mm = echo_to_mm_sse41,
+	.median5 = median5_sse41,
+	.delta = delta_sse41,
+};
+
+/* ~ AVX2 ~ */
+
+__attribute__((target("avx2")))
+static void echo_to_mm_avx2(const uint32_t *echo_ns, uint32_t *mm, size_t count, float temp_c) {
+	__m256 k = _mm256_set1_ps(mm_per_ns(temp_c)), half = _mm256_set1_ps(0.5f);
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(echo_ns + i)));
+
+		v = _mm256_add_ps(_mm256_mul_ps(v, k), half);
+		_mm256_storeu_si256((__m256i *)(mm + i), _mm256_cvttps_epi32(v));
+	}
+
+	echo_to_mm_scalar(echo_ns + i, mm + i, count - i, temp_c);
+}
+
+__attribute__((target("avx2")))
+static void median5_avx2(const uint32_t *in, uint32_t *out, size_t count) {
+	size_t i = 2;
+
+	if (count < 12) {
+		median5_scalar(in, out, count);
+		return;
+	}
+
+	median5_edges(in, out, count, 0, 2);
+
+	for (; i + 8 + 2 <= count; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(in + i - 2));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(in + i - 1));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(in + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(in + i + 1));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(in + i + 2));
+		__m256i t;
+
+		t = _mm256_min_epu32(a, b); b = _mm256_max_epu32(a, b); a = t;
+		t = _mm256_min_epu32(c, d); d = _mm256_max_epu32(c, d); c = t;
+		c = _mm256_max_epu32(a, c);
+		b = _mm256_min_epu32(b, d);
+		t = _mm256_min_epu32(b, c);
+		c = _mm256_max_epu32(b, c);
+
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_max_epu32(t, _mm256_min_epu32(c, e)));
+	}
+
+	median5_edges(in, out, count, i, count);
+}
+
+__attribute__((target("avx2")))
+static void delta_avx2(const uint32_t *in, int32_t *out, size_t count, uint32_t prev) {
+	size_t i = 1;
+
+	if (count == 0)
+		return;
+
+	out[0] = (int32_t)(in[0] - prev);
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i cur = _mm256_loadu_si256((const __m256i *)(in + i));
+		__m256i last = _mm256_loadu_si256((const __m256i *)(in + i - 1));
+
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_sub_epi32(cur, last));
+	}
+
+	delta_scalar(in + i, out + i, count - i, in[i - 1]);
+}
+
+static const struct hcsr04_kernels kernels_avx2 = {
+	.name = "avx2",
+	.echo_to_mm = echo_to_mm_avx2,
+	.median5 = median5_avx2,
+	.delta = delta_avx2,
+};
+
+#endif
+
+#ifdef HAVE_NEON
+
+/* ~ NEON ~ */
+
+static void echo_to_mm_neon(const uint32_t *echo_ns, uint32_t *mm, size_t count, float temp_c) {
+	float32x4_t k = vdupq_n_f32(mm_per_ns(temp_c)), half = vdupq_n_f32(0.5f);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		float32x4_t v = vcvtq_f32_s32(vreinterpretq_s32_u32(vld1q_u32(echo_ns + i)));
+
+		v = vaddq_f32(vmulq_f32(v, k), half);
+		vst1q_u32(mm + i, vcvtq_u32_f32(v));
+	}
+
+	echo_to_mm_scalar(echo_ns + i, mm + i, count - i, temp_c);
+}
+
+static void median5_neon(const uint32_t *in, uint32_t *out, size_t count) {
+	size_t i = 2;
+
+	if (count < 8) {
+		median5_scalar(in, out, count);
+		return;
+	}
+
+	median5_edges(in, out, count, 0, 2);
+
+	for (; i + 4 + 2 <= count; i += 4) {
+		uint32x4_t a = vld1q_u32(in + i - 2);
+		uint32x4_t b = vld1q_u32(in + i - 1);
+		uint32x4_t c = vld1q_u32(in + i);
+		uint32x4_t d = vld1q_u32(in + i + 1);
+		uint32x4_t e = vld1q_u32(in + i + 2);
+		uint32x4_t t;
+
+		t = vminq_u32(a, b); b = vmaxq_u32(a, b); a = t;
+		t = vminq_u32(c, d); d = vmaxq_u32(c, d); c = t;
+		c = vmaxq_u32(a, c);
+		b = vminq_u32(b, d);
+		t = vminq_u32(b, c);
+		c = vmaxq_u32(b, c);
+
+		vst1q_u32(out + i, vmaxq_u32(t, vminq_u32(c, e)));
+	}
+
+	median5_edges(in, out, count, i, count);
+}
+
+static void delta_neon(const uint32_t *in, int32_t *out, size_t count, uint32_t prev) {
+	size_t i = 1;
+
+	if (count == 0)
+		return;
+
+	out[0] = (int32_t)(in[0] - prev);
+
+	for (; i + 4 <= count; i += 4)
+		vst1q_s32(out + i, vreinterpretq_s32_u32(vsubq_u32(vld1q_u32(in + i), vld1q_u32(in + i - 1))));
+
+	delta_scalar(in + i, out + i, count - i, in[i - 1]);
+}
+
+static const struct hcsr04_kernels kernels_neon = {
+	.name = "neon",
+	.echo_to_mm = echo_to_mm_neon,
+	.median5 = median5_neon,
+	.delta = delta_neon,
+};
+
+#endif
+
+/* ~ Run time selection ~ */
+
+static const struct hcsr04_kernels *available[4];
+
+static void detect(void) {
+	int n = 0;
+
+	available[n++] = &hcsr04_kernels_scalar;
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.1"))
+		available[n++] = &kernels_sse41;
+	if (__builtin_cpu_supports("avx2"))
+		available[n++] = &kernels_avx2;
+#endif
+
+#ifdef HAVE_NEON
+	available[n++] = &kernels_neon;
+#endif
+
+	available[n] = NULL;
+}
+
+const struct hcsr04_kernels *const *hcsr04_kernels_available(void) {
+	if (!available[0])
+		detect();
+
+	return available;
+}
+
+const struct hcsr04_kernels *hcsr04_kernels_best(void) {
+	static const struct hcsr04_kernels *best;
+
+	if (!best) {
+		const struct hcsr04_kernels *const *k = hcsr04_kernels_available();
+
+		while (k[1])
+			k++;
+
+		best = *k;
+	}
+
+	return best;
+}
@@ -0,0 +1,54 @@
+#ifndef HCSR04_KERNELS_H
+#define HCSR04_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	Batch post-processing kernels over the column (SoA) layout of recorded samples: one array of
+ *	echo durations, one of distances and so on. Each kernel has a scalar reference and, where the
+ *	CPU has them, NEON, SSE4.1 and AVX2 versions. The fastest one is picked at run time.
+ *
+ *	Echo durations must be below 2^31 ns, the sensor itself never produces more than ~40 ms.
+ */
+
+struct hcsr04_kernels {
+	const char *name;
+
+	/* mm[i] = echo_ns[i] * speed_of_sound(temp_c) / 2, rounded to the nearest mm */
+	void (*echo_to_mm)(const uint32_t *echo_ns, uint32_t *mm, size_t count, float temp_c);
+
+	/* out[i] = median of in[i - 2] .. in[i + 2], the first and last values are repeated at the edges */
+	void (*median5)(const uint32_t *in, uint32_t *out, size_t count);
+
+	/* out[i] = in[i] - in[i - 1], with in[-1] = prev */
+	void (*delta)(const uint32_t *in, int32_t *out, size_t count, uint32_t prev);
+};
+
+extern const struct hcsr04_kernels hcsr04_kernels_scalar;
+
+/* All implementations usable on this CPU, scalar first and fastest last, NULL terminated */
+const struct hcsr04_kernels *const *hcsr04_kernels_available(void);
+const struct hcsr04_kernels *hcsr04_kernels_best(void);
+
+static inline void hcsr04_echo_to_mm(const uint32_t *echo_ns, uint32_t *mm, size_t count, float temp_c) {
+	hcsr04_kernels_best()->echo_to_mm(echo_ns, mm, count, temp_c);
+}
+
+static inline void hcsr04_median5(const uint32_t *in, uint32_t *out, size_t count) {
+	hcsr04_kernels_best()->median5(in, out, count);
+}
+
+static inline void hcsr04_delta(const uint32_t *in, int32_t *out, size_t count, uint32_t prev) {
+	hcsr04_kernels_best()->delta(in, out, count, prev);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hcsr04_rec.h"
+
+struct hcsr04_rec_writer {
+	FILE *file;
+	uint64_t offset;
+	struct hcsr04_rec_header header;
+	struct hcsr04_sample *pending[HCSR04_REC_MAX_SENSORS];
+	uint32_t pending_count[HCSR04_REC_MAX_SENSORS];
+	uint8_t *encoded;
+	struct hcsr04_rec_index *index;
+	size_t index_count, index_size;
+};
+
+struct hcsr04_rec_reader {
+	const uint8_t *map;
+	size_t size;
+	struct hcsr04_rec_header header;
+	const struct hcsr04_rec_index *index;
+	size_t index_count;
+};
+
+/* ~ Encoding ~ */
+
+static uint64_t zigzag(int64_t v) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+
+	return n;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+	unsigned int shift = 0;
+
+	*v = 0;
+
+	while (*p < end && shift < 64) {
+		uint8_t b = *(*p)++;
+
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/* ~ Writer ~ */
+
+static int write_all(struct hcsr04_rec_writer *w, const void *data, size_t len) {
+	if (fwrite(data, 1, len, w->file) != len)
+		return -1;
+
+	w->offset += len;
+
+	return 0;
+}
+
+static int flush_chunk(struct hcsr04_rec_writer *w, unsigned int sensor) {
+	const struct hcsr04_sample *s = w->pending[sensor];
+	uint32_t count = w->pending_count[sensor], unit = w->header.ts_unit_ns, i;
+	struct hcsr04_rec_chunk chunk = { 0 };
+	struct hcsr04_rec_index *entry;
+	int64_t last_t = 0, last_dt = 0;
+	uint32_t last_mm = 0;
+	size_t n = 0, mark;
+
+	if (count == 0)
+		return 0;
+
+	chunk.magic = HCSR04_REC_CHUNK_MAGIC;
+	chunk.sensor = sensor;
+	chunk.count = count;
+	chunk.first_ts = s[0].timestamp_ns;
+
+	for (i = 0; i < count; i++) {
+		int64_t t = (int64_t)((s[i].timestamp_ns - chunk.first_ts + unit / 2) / unit);
+
+		n += put_varint(w->encoded + n, zigzag((t - last_t) - last_dt));
+		last_dt = t - last_t;
+		last_t = t;
+	}
+	chunk.ts_bytes = n;
+
+	mark = n;
+	for (i = 0; i < count; i++) {
+		n += put_varint(w->encoded + n, zigzag((int64_t)s[i].distance_mm - last_mm));
+		last_mm = s[i].distance_mm;
+	}
+	chunk.distance_bytes = n - mark;
+
+	mark = n;
+	for (i = 0; i < count;) {
+		uint32_t run = 1;
+
+		while (i + run < count && s[i + run].flags == s[i].flags)
+			run++;
+
+		n += put_varint(w->encoded + n, s[i].flags);
+		n += put_varint(w->encoded + n, run);
+		i += run;
+	}
+	chunk.flags_bytes = n - mark;
+
+	if (w->index_count == w->index_size) {
+		size_t size = w->index_size ? w->index_size * 2 : 64;
+		struct hcsr04_rec_index *index = realloc(w->index, size * sizeof(*index));
+
+		if (!index)
+			return -1;
+
+		w->index = index;
+		w->index_size = size;
+	}
+
+	entry = &w->index[w->index_count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->offset = w->offset;
+	entry->first_ts = chunk.first_ts;
+	entry->last_ts = s[count - 1].timestamp_ns;
+	entry->count = count;
+	entry->sensor = sensor;
+
+	w->pending_count[sensor] = 0;
+
+	if (write_all(w, &chunk, sizeof(chunk)) || write_all(w, w->encoded, n))
+		return -1;
+
+	return 0;
+}
+
+struct hcsr04_rec_writer *hcsr04_rec_create(const char *path, uint32_t chunk_samples, uint32_t ts_unit_ns) {
+	struct hcsr04_rec_writer *w;
+
+	w = calloc(1, sizeof(*w));
+
+	if (!w)
+		return NULL;
+
+	memcpy(w->header.magic, HCSR04_REC_MAGIC, sizeof(w->header.magic));
+	w->header.version = HCSR04_REC_VERSION;
+	w->header.chunk_samples = chunk_samples ? chunk_samples : HCSR04_REC_DEFAULT_CHUNK;
+	w->header.ts_unit_ns = ts_unit_ns ? ts_unit_ns : HCSR04_REC_DEFAULT_TS_UNIT;
+
+	/* Worst case per sample: 10 bytes of timestamp, 5 of distance, 10 of flags run */
+	w->encoded = malloc((size_t)w->header.chunk_samples * 25);
+	w->file = fopen(path, "wb");
+
+	if (!w->encoded || !w->file || write_all(w, &w->header, sizeof(w->header))) {
+		if (w->file)
+			fclose(w->file);
+		free(w->encoded);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+int hcsr04_rec_append(struct hcsr04_rec_writer *w, unsigned int sensor, const struct hcsr04_sample *samples,
+		      size_t count) {
+	size_t i;
+
+	if (sensor >= HCSR04_REC_MAX_SENSORS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!w->pending[sensor]) {
+		w->pending[sensor] = malloc(w->header.chunk_samples * sizeof(*samples));
+
+		if (!w->pending[sensor])
+			return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		w->pending[sensor][w->pending_count[sensor]++] = samples[i];
+
+		if (w->pending_count[sensor] == w->header.chunk_samples && flush_chunk(w, sensor))
+			return -1;
+	}
+
+	return 0;
+}
+
+int hcsr04_rec_finish(struct hcsr04_rec_writer *w) {
+	static const uint8_t zero[8];
+	struct hcsr04_rec_trailer trailer = { 0 };
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < HCSR04_REC_MAX_SENSORS; i++) {
+		if (flush_chunk(w, i))
+			ret = -1;
+		free(w->pending[i]);
+	}
+
+	/* The index is used in place from the mapped file, so it has to be aligned */
+	if (write_all(w, zero, -w->offset & 7))
+		ret = -1;
+
+	trailer.index_offset = w->offset;
+	trailer.index_count = w->index_count;
+	trailer.magic = HCSR04_REC_INDEX_MAGIC;
+
+	if (write_all(w, w->index, w->index_count * sizeof(*w->index)) || write_all(w, &trailer, sizeof(trailer)))
+		ret = -1;
+
+	if (fclose(w->file))
+		ret = -1;
+
+	free(w->index);
+	free(w->encoded);
+	free(w);
+
+	return ret;
+}
+
+/* ~ Reader ~ */
+
+/*
+ *	Chunks are packed back to back and start at any byte offset, so the chunk headers (and, in a damaged file, the trailer) are
+ *	copied out of the map instead of being accessed in place. Only the index is aligned by the writer and used in place.
+ */
+
+struct hcsr04_rec_reader *hcsr04_rec_open(const char *path) {
+	struct hcsr04_rec_trailer trailer;
+	struct hcsr04_rec_reader *r;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+
+	if (!r) {
+		close(fd);
+		return NULL;
+	}
+
+	r->size = st.st_size;
+
+	if (r->size < sizeof(r->header) + sizeof(trailer)) {
+		close(fd);
+		free(r);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (r->map == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+
+	memcpy(&r->header, r->map, sizeof(r->header));
+	memcpy(&trailer, r->map + r->size - sizeof(trailer), sizeof(trailer));
+
+	if (memcmp(r->header.magic, HCSR04_REC_MAGIC, sizeof(r->header.magic)) ||
+	    r->header.version != HCSR04_REC_VERSION || trailer.magic != HCSR04_REC_INDEX_MAGIC ||
+	    trailer.index_offset + (uint64_t)trailer.index_count * sizeof(*r->index) + sizeof(trailer) != r->size ||
+	    trailer.index_offset % 8) {
+		hcsr04_rec_close(r);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r->index = (const struct hcsr04_rec_index *)(r->map + trailer.index_offset);
+	r->index_count = trailer.index_count;
+
+	/* Decoding reads the file front to back, whole chunks at a time */
+	madvise((void *)r->map, r->size, MADV_WILLNEED);
+
+	return r;
+}
+
+void hcsr04_rec_close(struct hcsr04_rec_reader *r) {
+	if (!r)
+		return;
+
+	munmap((void *)r->map, r->size);
+	free(r);
+}
+
+const struct hcsr04_rec_header *hcsr04_rec_file_header(const struct hcsr04_rec_reader *r) {
+	return &r->header;
+}
+
+size_t hcsr04_rec_size(const struct hcsr04_rec_reader *r) {
+	return r->size;
+}
+
+const struct hcsr04_rec_index *hcsr04_rec_chunks(const struct hcsr04_rec_reader *r, size_t *count) {
+	*count = r->index_count;
+
+	return r->index;
+}
+
+size_t hcsr04_rec_find(const struct hcsr04_rec_reader *r, unsigned int sensor, uint64_t timestamp_ns) {
+	size_t i;
+
+	/* Chunks of different sensors interleave, so the index is only sorted per sensor */
+	for (i = 0; i < r->index_count; i++) {
+		if (r->index[i].sensor == sensor && r->index[i].last_ts >= timestamp_ns)
+			return i;
+	}
+
+	return r->index_count;
+}
+
+int hcsr04_rec_decode(const struct hcsr04_rec_reader *r, size_t chunk, struct hcsr04_columns *out) {
+	const struct hcsr04_rec_index *entry;
+	struct hcsr04_rec_chunk chunk_header, *c = &chunk_header;
+	const uint8_t *data, *p, *end;
+	uint64_t unit = r->header.ts_unit_ns, v;
+	int64_t t = 0, dt = 0;
+	uint32_t mm = 0, i;
+
+	if (chunk >= r->index_count)
+		goto invalid;
+
+	entry = &r->index[chunk];
+
+	if (entry->offset + sizeof(*c) > r->size)
+		goto invalid;
+
+	memcpy(c, r->map + entry->offset, sizeof(*c));
+	data = r->map + entry->offset + sizeof(*c);
+	p = data;
+
+	if (c->magic != HCSR04_REC_CHUNK_MAGIC || c->count != entry->count ||
+	    entry->offset + sizeof(*c) + (uint64_t)c->ts_bytes + c->distance_bytes + c->flags_bytes > r->size)
+		goto invalid;
+
+	if (out->timestamp_ns) {
+		end = p + c->ts_bytes;
+		for (i = 0; i < c->count; i++) {
+			if (get_varint(&p, end, &v))
+				goto invalid;
+			dt += unzigzag(v);
+			t += dt;
+			out->timestamp_ns[i] = c->first_ts + t * unit;
+		}
+	}
+
+	p = data + c->ts_bytes;
+
+	if (out->distance_mm) {
+		end = p + c->distance_bytes;
+		for (i = 0; i < c->count; i++) {
+			if (get_varint(&p, end, &v))
+				goto invalid;
+			mm += (uint32_t)unzigzag(v);
+			out->distance_mm[i] = mm;
+		}
+	}
+
+	p = data + c->ts_bytes + c->distance_bytes;
+
+	if (out->flags) {
+		end = p + c->flags_bytes;
+		for (i = 0; i < c->count;) {
+			uint64_t flags, run;
+
+			if (get_varint(&p, end, &flags) || get_varint(&p, end, &run) || run > c->count - i)
+				goto invalid;
+			while (run--)
+				out->flags[i++] = flags;
+		}
+	}
+
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
@@ -0,0 +1,107 @@
+#ifndef HCSR04_REC_H
+#define HCSR04_REC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hcsr04.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	Recording format for long sensor sessions. The varints are byte order independent, the fixed size structs (header, chunk
+ *	header, index, trailer) are written in the host byte order. Every supported target is little endian; a file from a host of
+ *	the other byte order fails the version check in hcsr04_rec_open().
+ *
+ *	file:	header | chunk ... | index | trailer
+ *	header:	"HCSR04RC", version, timestamp unit in ns, samples per chunk, reserved
+ *	chunk:	chunk header | timestamps | distances | flags
+ *
+ *	A chunk holds up to chunk_samples consecutive samples of one sensor, stored as columns:
+ *	- timestamps: delta of delta of (timestamp - first_ts) / ts_unit_ns, zigzag varints
+ *	- distances: delta of distance_mm, zigzag varints
+ *	- flags: (value, run length) varint pairs
+ *	The index lists every chunk with its offset and time span, the trailer points at the index,
+ *	so a reader can map the file and jump to any chunk without scanning.
+ */
+
+#define HCSR04_REC_MAGIC		"HCSR04RC"
+#define HCSR04_REC_VERSION		1
+#define HCSR04_REC_CHUNK_MAGIC		0x4b4e4843u	/* "CHNK" */
+#define HCSR04_REC_INDEX_MAGIC		0x58444948u	/* "HIDX" */
+#define HCSR04_REC_MAX_SENSORS		16
+#define HCSR04_REC_DEFAULT_CHUNK	4096
+#define HCSR04_REC_DEFAULT_TS_UNIT	1000		/* 1 us */
+
+struct hcsr04_rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t ts_unit_ns;
+	uint32_t chunk_samples;
+	uint32_t reserved;
+};
+
+struct hcsr04_rec_chunk {
+	uint32_t magic;
+	uint16_t sensor;
+	uint16_t reserved;
+	uint32_t count;
+	uint32_t ts_bytes;
+	uint32_t distance_bytes;
+	uint32_t flags_bytes;
+	uint64_t first_ts;
+};
+
+struct hcsr04_rec_index {
+	uint64_t offset;
+	uint64_t first_ts;
+	uint64_t last_ts;
+	uint32_t count;
+	uint16_t sensor;
+	uint16_t reserved;
+};
+
+struct hcsr04_rec_trailer {
+	uint64_t index_offset;
+	uint32_t index_count;
+	uint32_t magic;
+};
+
+/* Decoded chunk, one array per field. Each array must hold the chunk's count entries */
+struct hcsr04_columns {
+	uint64_t *timestamp_ns;
+	uint32_t *distance_mm;
+	uint32_t *flags;
+};
+
+struct hcsr04_rec_writer;
+struct hcsr04_rec_reader;
+
+/* chunk_samples and ts_unit_ns of 0 select the defaults. Functions return 0 or -1 with errno set */
+struct hcsr04_rec_writer *hcsr04_rec_create(const char *path, uint32_t chunk_samples, uint32_t ts_unit_ns);
+int hcsr04_rec_append(struct hcsr04_rec_writer *w, unsigned int sensor, const struct hcsr04_sample *samples,
+		      size_t count);
+int hcsr04_rec_finish(struct hcsr04_rec_writer *w);
+
+struct hcsr04_rec_reader *hcsr04_rec_open(const char *path);
+void hcsr04_rec_close(struct hcsr04_rec_reader *r);
+
+const struct hcsr04_rec_header *hcsr04_rec_file_header(const struct hcsr04_rec_reader *r);
+/* Size of the recording in bytes */
+size_t hcsr04_rec_size(const struct hcsr04_rec_reader *r);
+
+/* The index points into the mapped file, it is valid until hcsr04_rec_close() */
+const struct hcsr04_rec_index *hcsr04_rec_chunks(const struct hcsr04_rec_reader *r, size_t *count);
+
+/* First chunk of the sensor that ends at or after timestamp, or the number of chunks if none */
+size_t hcsr04_rec_find(const struct hcsr04_rec_reader *r, unsigned int sensor, uint64_t timestamp_ns);
+
+int hcsr04_rec_decode(const struct hcsr04_rec_reader *r, size_t chunk, struct hcsr04_columns *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
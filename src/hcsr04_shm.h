@@ -0,0 +1,151 @@
+#ifndef HCSR04_SHM_H
+#define HCSR04_SHM_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "hcsr04.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	Layout of the shared memory segment published by hcsr04d. Every sensor has its own seqlock:
+ *	the daemon makes seq odd, updates the latest sample and the history ring, then makes it even
+ *	again. Readers copy what they need and retry if seq was odd or changed meanwhile, so they never
+ *	block the daemon or each other and never enter the kernel.
+ */
+
+#define HCSR04_SHM_NAME		"/hcsr04"
+#define HCSR04_SHM_MAGIC	0x48435352u	/* "HCSR" */
+#define HCSR04_SHM_VERSION	1
+#define HCSR04_SHM_MAX_SENSORS	16
+#define HCSR04_SHM_HISTORY	256		/* power of two */
+
+struct hcsr04_shm_sensor {
+	uint32_t seq;
+	uint32_t active;
+	uint64_t head;				/* samples published so far, history index is head % HISTORY */
+	char path[48];
+	struct hcsr04_sample latest;
+	struct hcsr04_sample history[HCSR04_SHM_HISTORY];
+} __attribute__((aligned(64)));
+
+struct hcsr04_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sensor_count;
+	uint32_t history_len;
+	struct hcsr04_shm_sensor sensors[HCSR04_SHM_MAX_SENSORS] __attribute__((aligned(64)));
+};
+
+static inline void hcsr04_shm_write_begin(struct hcsr04_shm_sensor *s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void hcsr04_shm_write_end(struct hcsr04_shm_sensor *s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t hcsr04_shm_read_begin(const struct hcsr04_shm_sensor *s) {
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+
+	return seq;
+}
+
+static inline int hcsr04_shm_read_retry(const struct hcsr04_shm_sensor *s, uint32_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Maps the segment read-only. Returns NULL if it does not exist or was made by another version */
+static inline const struct hcsr04_shm *hcsr04_shm_attach(const char *name) {
+	const struct hcsr04_shm *shm;
+	int fd;
+
+	fd = shm_open(name ? name : HCSR04_SHM_NAME, O_RDONLY, 0);
+
+	if (fd < 0)
+		return NULL;
+
+	shm = (const struct hcsr04_shm *)mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (shm->magic != HCSR04_SHM_MAGIC || shm->version != HCSR04_SHM_VERSION) {
+		munmap((void *)shm, sizeof(*shm));
+		return NULL;
+	}
+
+	return shm;
+}
+
+static inline void hcsr04_shm_detach(const struct hcsr04_shm *shm) {
+	munmap((void *)shm, sizeof(*shm));
+}
+
+/* Latest sample of a sensor, returns the number of samples published so far (0: none yet) */
+static inline uint64_t hcsr04_shm_latest(const struct hcsr04_shm *shm, unsigned int sensor,
+					 struct hcsr04_sample *sample) {
+	const struct hcsr04_shm_sensor *s = &shm->sensors[sensor];
+	uint64_t head;
+	uint32_t seq;
+
+	do {
+		seq = hcsr04_shm_read_begin(s);
+		head = s->head;
+		memcpy(sample, &s->latest, sizeof(*sample));
+	} while (hcsr04_shm_read_retry(s, seq));
+
+	return head;
+}
+
+/*
+ *	Copies up to count samples published since *cursor and advances it. Samples the daemon already
+ *	overwrote are skipped, so a reader that falls more than HCSR04_SHM_HISTORY behind loses the
+ *	oldest ones but is never blocked.
+ */
+
+static inline size_t hcsr04_shm_history(const struct hcsr04_shm *shm, unsigned int sensor, uint64_t *cursor,
+					struct hcsr04_sample *out, size_t count) {
+	const struct hcsr04_shm_sensor *s = &shm->sensors[sensor];
+	uint64_t head, from;
+	size_t n, i;
+	uint32_t seq;
+
+	do {
+		seq = hcsr04_shm_read_begin(s);
+		head = s->head;
+		from = *cursor;
+
+		if (head - from > HCSR04_SHM_HISTORY)
+			from = head - HCSR04_SHM_HISTORY;
+
+		n = head - from < count ? head - from : count;
+
+		for (i = 0; i < n; i++)
+			memcpy(&out[i], &s->history[(from + i) % HCSR04_SHM_HISTORY], sizeof(*out));
+	} while (hcsr04_shm_read_retry(s, seq));
+
+	*cursor = from + n;
+
+	return n;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hcsr04.h"
+#include "hcsr04_cal.h"
+
+/*
+ *	hcsr04cal - calibrates a sensor against targets at known distances and loads the result into the driver.
+ *
+ *	usage: hcsr04cal [-d device] [-m samples] [-i interval_ms] [-p] [-n] ref_mm ...
+ *
+ *	For every reference distance the tool waits for a line on stdin (place the target, press Enter; scripts can pipe
+ *	the lines), then collects the samples in the driver. A least squares gain/offset is loaded by default, -p loads
+ *	a piecewise table through the measured points instead and -n only prints the result.
+ */
+
+int main(int argc, char **argv) {
+	struct hcsr04_cal_point points[HCSR04_LUT_MAX];
+	const char *device = HCSR04_DEFAULT_DEVICE;
+	unsigned int samples = 32, interval_ms = 60;
+	int piecewise = 0, dry_run = 0, opt, i, count;
+	struct hcsr04_handle *dev;
+	struct hcsr04_lut lut;
+	double gain, offset;
+	char line[64];
+
+	while ((opt = getopt(argc, argv, "d:m:i:pn")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			samples = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'p':
+			piecewise = 1;
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	count = argc - optind;
+
+	if (count < 2 || count > HCSR04_LUT_MAX)
+		goto usage;
+
+	dev = hcsr04_open(device);
+
+	if (!dev) {
+		perror("hcsr04cal: open");
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct hcsr04_cal_collect stats;
+
+		points[i].ref_mm = atoi(argv[optind + i]);
+
+		printf("Place the target at %u mm and press Enter\n", points[i].ref_mm);
+		if (!fgets(line, sizeof(line), stdin) && ferror(stdin))
+			return 1;
+
+		if (hcsr04_cal_collect(dev, samples, interval_ms, &stats)) {
+			perror("hcsr04cal: collect");
+			return 1;
+		}
+
+		points[i].raw_mm = stats.median_mm;
+		printf("  %u/%u valid, median %u mm, mean %.1f mm, min %u mm, max %u mm\n", stats.valid, stats.samples,
+		       stats.median_mm, (double)stats.sum_mm / stats.valid, stats.min_mm, stats.max_mm);
+	}
+
+	if (hcsr04_cal_fit(points, count, &gain, &offset)) {
+		fprintf(stderr, "hcsr04cal: the measurements do not allow a fit\n");
+		return 1;
+	}
+
+	printf("gain %.5f, offset %.1f mm\n", gain, offset);
+
+	for (i = 0; i < count; i++)
+		printf("  %u mm: raw %u mm, fitted %.1f mm\n", points[i].ref_mm, points[i].raw_mm, gain * points[i].raw_mm + offset);
+
+	if (piecewise ? hcsr04_cal_piecewise_lut(points, count, &lut) : hcsr04_cal_linear_lut(gain, offset, &lut)) {
+		perror("hcsr04cal: table");
+		return 1;
+	}
+
+	if (!dry_run && hcsr04_set_lut(dev, &lut)) {
+		perror("hcsr04cal: set table");
+		return 1;
+	}
+
+	printf("%s %u point table%s\n", dry_run ? "computed" : "loaded", lut.count, piecewise ? "" : " (gain/offset)");
+
+	hcsr04_close(dev);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: hcsr04cal [-d device] [-m samples] [-i interval_ms] [-p] [-n] ref_mm ...\n");
+	return 2;
+}
@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "hcsr04.h"
+#include "hcsr04_shm.h"
+
+/*
+ *	hcsr04d - reads every sensor and publishes the samples into shared memory (see hcsr04_shm.h),
+ *	so any number of processes can use them without opening the devices.
+ *
+ *	usage: hcsr04d [-n shm_name] [device ...]		(default: all /dev/hcsr04_*)
+ *
+ *	Each sensor gets its own thread: a sensor that keeps timing out must not delay the others.
+ */
+
+struct sensor {
+	pthread_t thread;
+	struct hcsr04_handle *dev;
+	struct hcsr04_shm_sensor *slot;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+static void publish(struct hcsr04_shm_sensor *slot, const struct hcsr04_sample *samples, size_t count) {
+	size_t i;
+
+	if (count == 0)
+		return;
+
+	hcsr04_shm_write_begin(slot);
+
+	for (i = 0; i < count; i++)
+		slot->history[(slot->head + i) % HCSR04_SHM_HISTORY] = samples[i];
+
+	slot->latest = samples[count - 1];
+	slot->head += count;
+
+	hcsr04_shm_write_end(slot);
+}
+
+static void *sensor_thread(void *arg) {
+	struct sensor *sensor = arg;
+
+	while (!stop) {
+		const struct hcsr04_sample *samples;
+		size_t got;
+
+		/* Whatever the fastest mode is, a batch of one keeps the published data as fresh as possible */
+		samples = hcsr04_batch(sensor->dev, 1, &got);
+
+		if (!samples) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "hcsr04d: %s: %s\n", sensor->slot->path, strerror(errno));
+			break;
+		}
+
+		publish(sensor->slot, samples, got);
+	}
+
+	__atomic_store_n(&sensor->slot->active, 0, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	struct sensor sensors[HCSR04_SHM_MAX_SENSORS];
+	const char *name = HCSR04_SHM_NAME;
+	struct sigaction sa;
+	struct hcsr04_shm *shm;
+	glob_t paths = { 0 };
+	char **devices;
+	int i, count = 0, ndevices, fd, argi = 1;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		name = argv[2];
+		argi = 3;
+	}
+
+	if (argi < argc) {
+		devices = &argv[argi];
+		ndevices = argc - argi;
+	} else {
+		if (glob("/dev/hcsr04_*", 0, NULL, &paths)) {
+			fprintf(stderr, "hcsr04d: no sensors found\n");
+			return 1;
+		}
+		devices = paths.gl_pathv;
+		ndevices = paths.gl_pathc;
+	}
+
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+
+	if (fd < 0 || ftruncate(fd, sizeof(*shm))) {
+		perror("hcsr04d: shm_open");
+		return 1;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shm == MAP_FAILED) {
+		perror("hcsr04d: mmap");
+		return 1;
+	}
+
+	memset(shm, 0, sizeof(*shm));
+	shm->version = HCSR04_SHM_VERSION;
+	shm->history_len = HCSR04_SHM_HISTORY;
+
+	for (i = 0; i < ndevices && count < HCSR04_SHM_MAX_SENSORS; i++) {
+		struct sensor *sensor = &sensors[count];
+
+		sensor->dev = hcsr04_open(devices[i]);
+
+		if (!sensor->dev) {
+			fprintf(stderr, "hcsr04d: %s: %s\n", devices[i], strerror(errno));
+			continue;
+		}
+
+		sensor->slot = &shm->sensors[count];
+		snprintf(sensor->slot->path, sizeof(sensor->slot->path), "%s", devices[i]);
+		sensor->slot->active = 1;
+		printf("hcsr04d: sensor %d: %s (%s)\n", count, devices[i], hcsr04_mode_name(hcsr04_mode(sensor->dev)));
+		count++;
+	}
+
+	globfree(&paths);
+
+	if (count == 0) {
+		shm_unlink(name);
+		return 1;
+	}
+
+	shm->sensor_count = count;
+
+	/* The magic goes in last, readers that attach before this point see an invalid segment */
+	__atomic_store_n(&shm->magic, HCSR04_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < count; i++)
+		pthread_create(&sensors[i].thread, NULL, sensor_thread, &sensors[i]);
+
+	while (!stop)
+		sleep(1);
+
+	/* Kick threads still blocked in a read so they notice stop */
+	for (i = 0; i < count; i++)
+		pthread_kill(sensors[i].thread, SIGTERM);
+
+	for (i = 0; i < count; i++) {
+		pthread_join(sensors[i].thread, NULL);
+		hcsr04_close(sensors[i].dev);
+	}
+
+	shm_unlink(name);
+
+	return 0;
+}
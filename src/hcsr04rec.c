@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <glob.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hcsr04.h"
+#include "hcsr04_rec.h"
+
+/*
+ *	hcsr04rec - records sensor sessions in the hcsr04_rec.h format and reads them back.
+ *
+ *	usage:	hcsr04rec record <file> [-n samples] [device ...]	(default: all /dev/hcsr04_*)
+ *		hcsr04rec info <file>
+ *		hcsr04rec dump <file> [sensor]
+ */
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+static double now_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int record(int argc, char **argv) {
+	struct hcsr04_handle *devs[HCSR04_REC_MAX_SENSORS];
+	struct hcsr04_rec_writer *w;
+	unsigned long limit = 0, total = 0;
+	glob_t paths = { 0 };
+	struct sigaction sa;
+	char **devices;
+	int i, ndevices, count = 0, argi = 1;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		limit = strtoul(argv[2], NULL, 0);
+		argi = 3;
+	}
+
+	if (argi < argc) {
+		devices = &argv[argi];
+		ndevices = argc - argi;
+	} else {
+		if (glob("/dev/hcsr04_*", 0, NULL, &paths)) {
+			fprintf(stderr, "hcsr04rec: no sensors found\n");
+			return 1;
+		}
+		devices = paths.gl_pathv;
+		ndevices = paths.gl_pathc;
+	}
+
+	for (i = 0; i < ndevices && count < HCSR04_REC_MAX_SENSORS; i++) {
+		devs[count] = hcsr04_open(devices[i]);
+
+		if (!devs[count]) {
+			fprintf(stderr, "hcsr04rec: %s: %s\n", devices[i], strerror(errno));
+			continue;
+		}
+
+		fprintf(stderr, "hcsr04rec: sensor %d: %s (%s)\n", count, devices[i],
+			hcsr04_mode_name(hcsr04_mode(devs[count])));
+		count++;
+	}
+
+	globfree(&paths);
+
+	if (count == 0)
+		return 1;
+
+	w = hcsr04_rec_create(argv[0], 0, 0);
+
+	if (!w) {
+		perror("hcsr04rec: create");
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Sensors are pinged in turn, one after another, so they cannot hear each other's bursts */
+	while (!stop && (!limit || total < limit)) {
+		for (i = 0; i < count; i++) {
+			const struct hcsr04_sample *samples;
+			size_t got;
+
+			samples = hcsr04_batch(devs[i], 1, &got);
+
+			if (!samples) {
+				if (errno != EINTR)
+					perror("hcsr04rec: read");
+				stop = 1;
+				break;
+			}
+
+			if (hcsr04_rec_append(w, i, samples, got)) {
+				perror("hcsr04rec: write");
+				stop = 1;
+				break;
+			}
+
+			total += got;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		hcsr04_close(devs[i]);
+
+	if (hcsr04_rec_finish(w)) {
+		perror("hcsr04rec: write");
+		return 1;
+	}
+
+	fprintf(stderr, "hcsr04rec: %lu samples\n", total);
+
+	return 0;
+}
+
+static void free_columns(struct hcsr04_columns *cols) {
+	free(cols->timestamp_ns);
+	free(cols->distance_mm);
+	free(cols->flags);
+}
+
+static int info(const char *path) {
+	const struct hcsr04_rec_index *index;
+	struct hcsr04_rec_reader *r;
+	struct hcsr04_columns cols;
+	uint64_t samples = 0;
+	size_t chunks, i, max = 0, size;
+	double t;
+
+	t = now_s();
+	r = hcsr04_rec_open(path);
+
+	if (!r) {
+		perror("hcsr04rec: open");
+		return 1;
+	}
+
+	index = hcsr04_rec_chunks(r, &chunks);
+
+	for (i = 0; i < chunks; i++) {
+		if (index[i].count > max)
+			max = index[i].count;
+	}
+
+	cols.timestamp_ns = malloc(max * sizeof(*cols.timestamp_ns));
+	cols.distance_mm = malloc(max * sizeof(*cols.distance_mm));
+	cols.flags = malloc(max * sizeof(*cols.flags));
+
+	if (max && (!cols.timestamp_ns || !cols.distance_mm || !cols.flags)) {
+		perror("hcsr04rec: malloc");
+		free_columns(&cols);
+		hcsr04_rec_close(r);
+		return 1;
+	}
+
+	for (i = 0; i < chunks; i++) {
+		if (hcsr04_rec_decode(r, i, &cols)) {
+			fprintf(stderr, "hcsr04rec: chunk %zu is corrupt\n", i);
+			break;
+		}
+		samples += index[i].count;
+	}
+
+	t = now_s() - t;
+
+	size = hcsr04_rec_size(r);
+
+	printf("%zu chunks, %llu samples, %zu bytes (%.2f bytes/sample)\n", chunks, (unsigned long long)samples,
+	       size, samples ? (double)size / samples : 0.0);
+	printf("decoded in %.3f ms\n", t * 1e3);
+
+	free_columns(&cols);
+	hcsr04_rec_close(r);
+
+	return 0;
+}
+
+static int dump(const char *path, int sensor) {
+	const struct hcsr04_rec_index *index;
+	struct hcsr04_rec_reader *r;
+	struct hcsr04_columns cols;
+	size_t chunks, i, j;
+	uint32_t chunk_samples;
+
+	r = hcsr04_rec_open(path);
+
+	if (!r) {
+		perror("hcsr04rec: open");
+		return 1;
+	}
+
+	index = hcsr04_rec_chunks(r, &chunks);
+	chunk_samples = hcsr04_rec_file_header(r)->chunk_samples;
+
+	cols.timestamp_ns = malloc(chunk_samples * sizeof(*cols.timestamp_ns));
+	cols.distance_mm = malloc(chunk_samples * sizeof(*cols.distance_mm));
+	cols.flags = malloc(chunk_samples * sizeof(*cols.flags));
+
+	if (!cols.timestamp_ns || !cols.distance_mm || !cols.flags) {
+		perror("hcsr04rec: malloc");
+		free_columns(&cols);
+		hcsr04_rec_close(r);
+		return 1;
+	}
+
+	printf("sensor,timestamp_ns,distance_mm,flags\n");
+
+	for (i = 0; i < chunks; i++) {
+		if (sensor >= 0 && index[i].sensor != sensor)
+			continue;
+
+		if (index[i].count > chunk_samples || hcsr04_rec_decode(r, i, &cols)) {
+			fprintf(stderr, "hcsr04rec: chunk %zu is corrupt\n", i);
+			break;
+		}
+
+		for (j = 0; j < index[i].count; j++)
+			printf("%u,%llu,%u,%u\n", index[i].sensor, (unsigned long long)cols.timestamp_ns[j],
+			       cols.distance_mm[j], cols.flags[j]);
+	}
+
+	free_columns(&cols);
+	hcsr04_rec_close(r);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc >= 3 && !strcmp(argv[1], "record"))
+		return record(argc - 2, argv + 2);
+	if (argc == 3 && !strcmp(argv[1], "info"))
+		return info(argv[2]);
+	if ((argc == 3 || argc == 4) && !strcmp(argv[1], "dump"))
+		return dump(argv[2], argc == 4 ? atoi(argv[3]) : -1);
+
+	fprintf(stderr, "usage: hcsr04rec record <file> [-n samples] [device ...]\n"
+			"       hcsr04rec info <file>\n"
+			"       hcsr04rec dump <file> [sensor]\n");
+
+	return 2;
+}
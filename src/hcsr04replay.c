@@ -0,0 +1,364 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hcsr04.h"
+#include "hcsr04_rec.h"
+
+/*
+ *	hcsr04replay - plays a recorded session back into a gpio-sim echo line and reads it through the
+ *	real driver, so the whole stack can be measured on machines without sensors.
+ *
+ *	usage: hcsr04replay [-d device] [-S sensor] [-s speed] [-l lead_us] <session.rec> <sim_gpio dir>
+ *
+ *	The sim_gpio directory is the echo line of the gpio-sim chip, for example
+ *	/sys/devices/platform/gpio-sim.0/gpiochip2/sim_gpio3. The driver's TRIGGER_PIN, ECHO_PIN and
+ *	OFFSET_PIN must point at that chip.
+ *
+ *	Every sample gets an absolute start time that keeps the recorded spacing (divided by speed, but
+ *	never closer than the driver needs, see driver_gap()). The reader thread calls read() at the start time, the edge
+ *	thread runs with SCHED_FIFO and raises the echo lead_us later, then drops it after the recorded
+ *	echo duration. Both sleep with clock_nanosleep(TIMER_ABSTIME), so errors do not accumulate.
+ */
+
+#define NSEC_PER_SEC	1000000000ll
+#define NS_PER_MM	5800			/* round trip time per mm, the driver uses 58000 ns per cm */
+#define DRIVER_TIMEOUT_MS	50			/* TIMEOUT in the driver, if sysfs cannot be read */
+#define DRIVER_GUARD_US		10000			/* default ping_guard_us */
+#define JIFFY_MAX_NS		10000000ll		/* one jiffy at HZ=100, the driver's wait rounds up to jiffies */
+
+struct replay {
+	uint64_t *start;			/* absolute CLOCK_MONOTONIC start time of each sample */
+	uint32_t *distance_mm;
+	uint32_t *flags;
+	size_t count;
+	int64_t lead_ns;
+	int pull_fd;
+	struct hcsr04_handle *dev;
+	struct hcsr04_sample *measured;
+	uint64_t *returned;
+	size_t done;				/* samples the reader got, valid after it is joined */
+	atomic_bool stop;			/* set by the reader thread when it gives up, the edge thread stops too */
+};
+
+static void sleep_until(uint64_t t) {
+	struct timespec ts = { t / NSEC_PER_SEC, t % NSEC_PER_SEC };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void set_echo(int fd, int high) {
+	const char *pull = high ? "pull-up" : "pull-down";
+
+	if (pwrite(fd, pull, strlen(pull), 0) < 0)
+		perror("hcsr04replay: pull");
+}
+
+static long read_sysfs(const char *path, long fallback) {
+	FILE *f = fopen(path, "r");
+	long val;
+
+	if (!f || fscanf(f, "%ld", &val) != 1) {
+		fprintf(stderr, "hcsr04replay: cannot read %s, assuming %ld\n", path, fallback);
+		val = fallback;
+	}
+
+	if (f)
+		fclose(f);
+
+	return val;
+}
+
+/*
+ *	Shortest spacing between two samples the driver can follow: a ping may wait timeout_ms (rounded up to the next jiffy) for
+ *	its echo, and the next one starts ping_guard_us after that. Both are read from the running driver.
+ */
+
+static int64_t driver_gap(const char *device, int64_t lead_ns) {
+	char path[256], name[128];
+	long timeout_ms, guard_us;
+
+	snprintf(name, sizeof(name), "%s", device);
+	snprintf(path, sizeof(path), "/sys/class/hcsr04/%s/timeout_ms", basename(name));
+	timeout_ms = read_sysfs(path, DRIVER_TIMEOUT_MS);
+	guard_us = read_sysfs("/sys/module/hcsr04_driver/parameters/ping_guard_us", DRIVER_GUARD_US);
+
+	return 2 * lead_ns + timeout_ms * 1000000ll + JIFFY_MAX_NS + guard_us * 1000ll;
+}
+
+static void *edge_thread(void *arg) {
+	struct replay *rp = arg;
+	size_t i;
+
+	for (i = 0; i < rp->count && !atomic_load(&rp->stop); i++) {
+		uint64_t rise = rp->start[i] + rp->lead_ns;
+
+		if (rp->flags[i])
+			continue;
+
+		sleep_until(rise);
+		set_echo(rp->pull_fd, 1);
+		sleep_until(rise + (uint64_t)rp->distance_mm[i] * NS_PER_MM);
+		set_echo(rp->pull_fd, 0);
+	}
+
+	return NULL;
+}
+
+static void *reader_thread(void *arg) {
+	struct replay *rp = arg;
+	size_t i;
+
+	for (i = 0; i < rp->count; i++) {
+		sleep_until(rp->start[i]);
+
+		if (hcsr04_read(rp->dev, &rp->measured[i])) {
+			perror("hcsr04replay: read");
+			atomic_store(&rp->stop, true);
+			break;
+		}
+
+		rp->returned[i] = now_ns();
+	}
+
+	rp->done = i;
+
+	return NULL;
+}
+
+static int load(struct replay *rp, const char *path, unsigned int sensor, double speed, int64_t min_gap) {
+	const struct hcsr04_rec_index *index;
+	struct hcsr04_rec_reader *r;
+	struct hcsr04_columns cols;
+	size_t chunks, i, n = 0;
+	uint64_t first = 0, t;
+
+	r = hcsr04_rec_open(path);
+
+	if (!r)
+		return -1;
+
+	index = hcsr04_rec_chunks(r, &chunks);
+
+	for (i = 0; i < chunks; i++) {
+		if (index[i].sensor == sensor)
+			n += index[i].count;
+	}
+
+	rp->start = malloc(n * sizeof(*rp->start));
+	rp->distance_mm = malloc(n * sizeof(*rp->distance_mm));
+	rp->flags = malloc(n * sizeof(*rp->flags));
+	rp->measured = calloc(n, sizeof(*rp->measured));
+	rp->returned = calloc(n, sizeof(*rp->returned));
+
+	if (!rp->start || !rp->distance_mm || !rp->flags || !rp->measured || !rp->returned) {
+		hcsr04_rec_close(r);
+		return -1;
+	}
+
+	/* Decode straight into the replay arrays, the recorded timestamps land in start[] */
+	for (i = 0; i < chunks; i++) {
+		if (index[i].sensor != sensor)
+			continue;
+
+		cols.timestamp_ns = rp->start + rp->count;
+		cols.distance_mm = rp->distance_mm + rp->count;
+		cols.flags = rp->flags + rp->count;
+
+		if (hcsr04_rec_decode(r, i, &cols)) {
+			hcsr04_rec_close(r);
+			return -1;
+		}
+
+		rp->count += index[i].count;
+	}
+
+	hcsr04_rec_close(r);
+
+	/* Turn recorded times into start times, one second from now */
+	t = now_ns() + NSEC_PER_SEC;
+
+	for (i = 0; i < rp->count; i++) {
+		int64_t gap = i ? (int64_t)((rp->start[i] - first) / speed) : 0;
+
+		first = rp->start[i];
+
+		if (i && gap < min_gap)
+			gap = min_gap;
+
+		t += gap;
+		rp->start[i] = t;
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct replay *rp) {
+	size_t i, ok = 0, timeouts = 0, missed = 0, spurious = 0, n = 0;
+	uint64_t *latency, err_sum = 0, err_max = 0;
+	double seconds;
+
+	latency = malloc(rp->count * sizeof(*latency));
+
+	for (i = 0; i < rp->count; i++) {
+		const struct hcsr04_sample *m = &rp->measured[i];
+		uint64_t end, err;
+
+		if (rp->flags[i]) {
+			if (m->flags)
+				timeouts++;
+			else
+				spurious++;
+			continue;
+		}
+
+		if (m->flags) {
+			missed++;
+			continue;
+		}
+
+		/* The driver reports whole cm, anything within one cm is a match */
+		err = m->distance_mm > rp->distance_mm[i] ? m->distance_mm - rp->distance_mm[i]
+							   : rp->distance_mm[i] - m->distance_mm;
+		err_sum += err;
+		if (err > err_max)
+			err_max = err;
+		if (err < 10)
+			ok++;
+
+		end = rp->start[i] + rp->lead_ns + (uint64_t)rp->distance_mm[i] * NS_PER_MM;
+		latency[n++] = rp->returned[i] > end ? rp->returned[i] - end : 0;
+	}
+
+	seconds = rp->count ? (rp->returned[rp->count - 1] - rp->start[0]) / 1e9 : 0;
+
+	printf("samples      %zu in %.3f s (%.1f samples/s)\n", rp->count, seconds, seconds > 0 ? rp->count / seconds : 0);
+	printf("matched      %zu/%zu within 1 cm, mean error %.2f mm, max %llu mm\n", ok, n + missed,
+	       n ? (double)err_sum / n : 0.0, (unsigned long long)err_max);
+	printf("timeouts     %zu expected, %zu missed echoes, %zu unexpected samples\n", timeouts, missed, spurious);
+
+	if (n) {
+		qsort(latency, n, sizeof(*latency), cmp_u64);
+		printf("latency      p50 %.1f us, p99 %.1f us, max %.1f us (echo end to read() return)\n",
+		       latency[n / 2] / 1e3, latency[n * 99 / 100] / 1e3, latency[n - 1] / 1e3);
+	}
+
+	free(latency);
+}
+
+int main(int argc, char **argv) {
+	const char *device = HCSR04_DEFAULT_DEVICE;
+	struct replay rp = { 0 };
+	struct sched_param param = { 0 };
+	pthread_attr_t attr;
+	pthread_t edges, reader;
+	unsigned int sensor = 0;
+	double speed = 1.0;
+	char pull[512];
+	int opt;
+
+	rp.lead_ns = 500000;
+
+	while ((opt = getopt(argc, argv, "d:S:s:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'S':
+			sensor = atoi(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'l':
+			rp.lead_ns = atol(optarg) * 1000;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2 || speed <= 0)
+		goto usage;
+
+	if (load(&rp, argv[optind], sensor, speed, driver_gap(device, rp.lead_ns))) {
+		perror("hcsr04replay: load");
+		return 1;
+	}
+
+	snprintf(pull, sizeof(pull), "%s/pull", argv[optind + 1]);
+	rp.pull_fd = open(pull, O_WRONLY);
+
+	if (rp.pull_fd < 0) {
+		perror("hcsr04replay: sim_gpio");
+		return 1;
+	}
+
+	set_echo(rp.pull_fd, 0);
+
+	rp.dev = hcsr04_open(device);
+
+	if (!rp.dev) {
+		perror("hcsr04replay: open");
+		return 1;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		perror("hcsr04replay: mlockall");
+
+	/* Only the edges need real-time priority, the driver timestamps them in its interrupt handler */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+
+	if (pthread_create(&edges, &attr, edge_thread, &rp)) {
+		fprintf(stderr, "hcsr04replay: no SCHED_FIFO, edge timing will be less accurate\n");
+		pthread_create(&edges, NULL, edge_thread, &rp);
+	}
+
+	pthread_create(&reader, NULL, reader_thread, &rp);
+
+	pthread_join(reader, NULL);
+	pthread_join(edges, NULL);
+
+	/* both threads are gone, only now is it safe to cut the trace down to what was read */
+	rp.count = rp.done;
+
+	report(&rp);
+
+	hcsr04_close(rp.dev);
+	close(rp.pull_fd);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: hcsr04replay [-d device] [-S sensor] [-s speed] [-l lead_us] <session.rec> <sim_gpio dir>\n");
+	return 2;
+}